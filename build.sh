@@ -1,5 +1,8 @@
 # macOS (clang)
 clang fragger.c -o fragger -framework SDL2 -O2
 
+# linux (gcc)
+# gcc fragger.c -o fragger -lSDL2 -lEGL -ldl -lm -O2
+
 # windows (MinGW)
 # gcc fragger.c -o fragger -mwindows -lmingw32 -lSDL2main -lSDL2 -O2
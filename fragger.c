@@ -6,55 +6,4194 @@
 //
 
 #include <SDL2/SDL.h>
+#include <time.h>
+#include <dirent.h>
 #include "glad.c"
 
+// Used to hand standard output over to streamed frame data.
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <signal.h>
+#endif
+
+// Used to run the benchmark suite's shaders in their own processes.
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <sys/wait.h>
+#include <errno.h>
+#endif
+
+// Used to notice when the shader file is saved.
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+// Used to memory-map cached textures.
+#include <utime.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
+
+// Headless rendering uses EGL, which is only available here on Linux (via Mesa).
+#ifdef __linux__
+#define HEADLESS_SUPPORTED
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
 typedef Uint64 u64;
 
-// You can change the names of the uniforms here if you like.
-#define UNIFORM_RESOLUTION "resolution"
-#define UNIFORM_MOUSE "mouse"
-#define UNIFORM_TIME "time"
-#define UNIFORM_RANDOM "random"
-#define UNIFORM_BUTTON "button"
+// You can change the names of the uniforms here if you like.
+#define UNIFORM_RESOLUTION "resolution"
+#define UNIFORM_MOUSE "mouse"
+#define UNIFORM_TIME "time"
+#define UNIFORM_DELTA "delta"
+#define UNIFORM_FRAME "frame"
+#define UNIFORM_RANDOM "random"
+#define UNIFORM_BUTTON "button"
+#define UNIFORM_DATE "date"
+#define UNIFORM_CHANNEL "channel%d"
+#define UNIFORM_BLOCK "Fragger"
+
+// Exit the program, displaying an error message via pop-up box and print out.
+void panic_exit(char * message, ...) {
+    va_list args;
+    va_start(args, message);
+    char buffer[512];
+    vsnprintf(buffer, 512, message, args);
+    va_end(args);
+    puts(buffer);
+    SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error!", buffer, NULL);
+    exit(1);
+}
+
+// Pseudo-random number generator.
+// (Xoroshiro128+)
+u64 random_seed[2] = { 0, 0 };
+
+u64 random_u64() {
+    u64 s0 = random_seed[0];
+    u64 s1 = random_seed[1];
+    u64 result = s0 + s1;
+    s1 ^= s0;
+    #define LS(x, k) ((x << k) | (x >> (64 - k)))
+    random_seed[0] = LS(s0, 55) ^ s1 ^ (s1 << 14);
+    random_seed[1] = LS(s1, 36);
+    #undef LS
+    return result;
+}
+
+// Set the seed for the pseudo-random number generator.
+void set_seed(u64 a, u64 b) {
+    random_seed[0] = a;
+    random_seed[1] = b;
+    for (int i = 0; i < 64; ++i) random_u64();
+}
+
+// Get a random float between 0.0 and 1.0.
+float random_float() {
+    return (float)random_u64() / (float)UINT64_MAX;
+}
+
+// The window and OpenGL context that the main thread renders with.
+// The window is NULL in headless mode.
+SDL_Window * gl_window = NULL;
+SDL_GLContext gl_context = NULL;
+
+#ifdef HEADLESS_SUPPORTED
+// EGL state for the headless context, kept so that worker threads can share it.
+EGLDisplay headless_display = EGL_NO_DISPLAY;
+EGLConfig headless_config;
+EGLint headless_context_attributes[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 3,
+    EGL_CONTEXT_MINOR_VERSION, 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE
+};
+
+// Create an OpenGL 3.3 core context that has no window or display attached.
+// This uses Mesa's surfaceless EGL platform, so it works on machines with no
+// GPU (via llvmpipe) and no X11 or Wayland server.
+void create_headless_context() {
+    EGLDisplay display = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display) {
+        display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+        panic_exit("Could not initialise EGL (error 0x%x).", eglGetError());
+    }
+
+    // We never create a surface, so any config that can render OpenGL will do.
+    EGLint config_attributes[] = {
+        EGL_SURFACE_TYPE, EGL_DONT_CARE,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLint config_count = 0;
+    if (!eglChooseConfig(display, config_attributes, &headless_config, 1, &config_count) || !config_count) {
+        panic_exit("Could not find a suitable EGL config (error 0x%x).", eglGetError());
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        panic_exit("EGL does not support desktop OpenGL (error 0x%x).", eglGetError());
+    }
+
+    EGLContext context = eglCreateContext(display, headless_config,
+        EGL_NO_CONTEXT, headless_context_attributes);
+    if (context == EGL_NO_CONTEXT) {
+        panic_exit("Could not create headless OpenGL context (error 0x%x).", eglGetError());
+    }
+
+    // Bind the context without a surface (EGL_KHR_surfaceless_context).
+    if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        panic_exit("Could not make headless OpenGL context current (error 0x%x).", eglGetError());
+    }
+
+    headless_display = display;
+    gl_context = context;
+}
+#endif
+
+// Another OpenGL context that shares objects (buffers, textures, programs and
+// syncs) with the main one, so that a worker thread can use it. A drawable
+// can only be current in one thread at a time (EGL refuses otherwise), so
+// with a window the context gets a hidden window of its own. Headless
+// contexts need no drawable.
+typedef struct {
+    void * context;
+    SDL_Window * window;
+} SharedContext;
+
+// Must be called from the main thread. If the context cannot be created, its
+// context is NULL and the work should be done on the main thread instead.
+SharedContext create_shared_context() {
+    SharedContext shared = { 0 };
+#ifdef HEADLESS_SUPPORTED
+    if (!gl_window) {
+        EGLContext context = eglCreateContext(headless_display, headless_config,
+            gl_context, headless_context_attributes);
+        if (context != EGL_NO_CONTEXT) shared.context = context;
+        return shared;
+    }
+#endif
+    shared.window = SDL_CreateWindow("", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 1, 1,
+        SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+    if (!shared.window) return shared;
+    // SDL makes the new context current, so switch back to the main one afterwards.
+    SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 1);
+    shared.context = SDL_GL_CreateContext(shared.window);
+    SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 0);
+    SDL_GL_MakeCurrent(gl_window, gl_context);
+    if (!shared.context) {
+        SDL_DestroyWindow(shared.window);
+        shared.window = NULL;
+    }
+    return shared;
+}
+
+// Bind a shared context to the calling thread, or with NULL release the
+// thread's context. Returns 0 if that failed.
+int make_context_current(SharedContext * shared) {
+#ifdef HEADLESS_SUPPORTED
+    if (!gl_window) {
+        return eglMakeCurrent(headless_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+            shared ? shared->context : EGL_NO_CONTEXT) == EGL_TRUE;
+    }
+#endif
+    if (!shared) return SDL_GL_MakeCurrent(NULL, NULL) == 0;
+    return shared->context && SDL_GL_MakeCurrent(shared->window, shared->context) == 0;
+}
+
+// Must be called from the main thread, once no thread has the context current.
+void destroy_shared_context(SharedContext * shared) {
+#ifdef HEADLESS_SUPPORTED
+    if (!gl_window) {
+        if (shared->context) eglDestroyContext(headless_display, shared->context);
+        memset(shared, 0, sizeof(*shared));
+        return;
+    }
+#endif
+    if (shared->context) SDL_GL_DeleteContext(shared->context);
+    if (shared->window) SDL_DestroyWindow(shared->window);
+    memset(shared, 0, sizeof(*shared));
+}
+
+// Look up an OpenGL function that glad does not load.
+void * get_gl_proc_address(char * name) {
+#ifdef HEADLESS_SUPPORTED
+    if (!gl_window) return (void *)eglGetProcAddress(name);
+#endif
+    return SDL_GL_GetProcAddress(name);
+}
+
+int has_gl_extension(char * name) {
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (int i = 0; i < count; ++i) {
+        if (!strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), name)) return 1;
+    }
+    return 0;
+}
+
+// Linked programs are cached on disk with glGetProgramBinary (OpenGL 4.1, or
+// ARB_get_program_binary), so a shader that has been built before can be
+// loaded with glProgramBinary instead of being compiled again. Entries are
+// keyed by a hash of the shader sources and the driver's vendor, renderer
+// and version strings, so a driver update simply misses. A binary the driver
+// rejects anyway falls back to a normal build, which replaces the entry.
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+
+typedef void (APIENTRYP GetProgramBinaryProc)(GLuint, GLsizei, GLsizei *, GLenum *, void *);
+typedef void (APIENTRYP ProgramBinaryProc)(GLuint, GLenum, const void *, GLsizei);
+typedef void (APIENTRYP ProgramParameteriProc)(GLuint, GLenum, GLint);
+
+struct {
+    int enabled;
+    char directory[1024];
+    u64 driver_hash;
+    GetProgramBinaryProc get_program_binary;
+    ProgramBinaryProc program_binary;
+    ProgramParameteriProc program_parameteri;
+} program_cache;
+
+// 64-bit FNV-1a, continuing from a previous hash.
+u64 hash_bytes(u64 hash, const unsigned char * bytes, size_t length) {
+    for (size_t i = 0; i < length; ++i) hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+u64 hash_string(u64 hash, const char * string) {
+    return hash_bytes(hash, (const unsigned char *)string, strlen(string));
+}
+
+void make_directory(char * path) {
+#ifdef _WIN32
+    mkdir(path);
+#else
+    mkdir(path, 0755);
+#endif
+}
+
+// Find (and create) fragger's cache directory. Returns 0 if there is nowhere to put it.
+int find_cache_directory(char * directory, int size) {
+    char * base = getenv("XDG_CACHE_HOME");
+    char * home = getenv("HOME");
+#ifdef _WIN32
+    if (!base) base = getenv("LOCALAPPDATA");
+#endif
+    if (base && *base) {
+        snprintf(directory, size, "%s/fragger", base);
+    } else if (home && *home) {
+        snprintf(directory, size, "%s/.cache", home);
+        make_directory(directory);
+        snprintf(directory, size, "%s/.cache/fragger", home);
+    } else {
+        return 0;
+    }
+    make_directory(directory);
+    return 1;
+}
+
+// Find the cache directory, and load the functions.
+// If anything is missing the cache is left disabled.
+void program_cache_init() {
+    memset(&program_cache, 0, sizeof(program_cache));
+    GLint format_count = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &format_count);
+    GLint major = 0, minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    int supported = major > 4 || (major == 4 && minor >= 1) || has_gl_extension("GL_ARB_get_program_binary");
+    if (!supported || format_count < 1) return;
+
+    if (!find_cache_directory(program_cache.directory, sizeof(program_cache.directory))) return;
+
+    program_cache.get_program_binary = get_gl_proc_address("glGetProgramBinary");
+    program_cache.program_binary = get_gl_proc_address("glProgramBinary");
+    program_cache.program_parameteri = get_gl_proc_address("glProgramParameteri");
+    if (!program_cache.get_program_binary || !program_cache.program_binary
+     || !program_cache.program_parameteri) {
+        return;
+    }
+
+    u64 hash = 0xcbf29ce484222325ull;
+    hash = hash_string(hash, (const char *)glGetString(GL_VENDOR));
+    hash = hash_string(hash, (const char *)glGetString(GL_RENDERER));
+    hash = hash_string(hash, (const char *)glGetString(GL_VERSION));
+    program_cache.driver_hash = hash;
+    program_cache.enabled = 1;
+}
+
+// Each entry is a small header followed by the driver's binary.
+#define PROGRAM_CACHE_MAGIC 0x42475246u
+
+typedef struct {
+    Uint32 magic;
+    Uint32 format;
+    Uint32 length;
+    Uint32 reserved;
+    u64 key;
+} ProgramCacheHeader;
+
+u64 program_cache_key(char * vertex, char * fragment) {
+    return hash_string(hash_string(program_cache.driver_hash, vertex), fragment);
+}
+
+void program_cache_path(u64 key, char * path, int path_size) {
+    snprintf(path, path_size, "%s/%016llx.bin", program_cache.directory, (unsigned long long)key);
+}
+
+// Returns a linked program, or 0 if there is no usable entry.
+GLuint program_cache_load(u64 key) {
+    if (!program_cache.enabled) return 0;
+    char path[1100];
+    program_cache_path(key, path, sizeof(path));
+    FILE * file = fopen(path, "rb");
+    if (!file) return 0;
+
+    GLuint program = 0;
+    ProgramCacheHeader header;
+    void * binary = NULL;
+    if (fread(&header, sizeof(header), 1, file) == 1
+     && header.magic == PROGRAM_CACHE_MAGIC && header.key == key
+     && (binary = malloc(header.length))
+     && fread(binary, 1, header.length, file) == header.length) {
+        program = glCreateProgram();
+        program_cache.program_parameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        program_cache.program_binary(program, header.format, binary, header.length);
+        GLint status = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        if (status != GL_TRUE) {
+            glDeleteProgram(program);
+            program = 0;
+        }
+    }
+    free(binary);
+    fclose(file);
+    return program;
+}
+
+// Store a linked program. Written to a temporary file and renamed into place,
+// so that another fragger reading the cache never sees half an entry.
+void program_cache_store(u64 key, GLuint program) {
+    if (!program_cache.enabled) return;
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+    void * binary = malloc(length);
+    if (!binary) return;
+    GLenum format = 0;
+    program_cache.get_program_binary(program, length, &length, &format, binary);
+
+    char path[1100], temporary_path[1200];
+    program_cache_path(key, path, sizeof(path));
+    snprintf(temporary_path, sizeof(temporary_path), "%s.%u.tmp", path, (unsigned)SDL_GetTicks());
+    ProgramCacheHeader header = { PROGRAM_CACHE_MAGIC, format, length, 0, key };
+    FILE * file = fopen(temporary_path, "wb");
+    if (file) {
+        int written = fwrite(&header, sizeof(header), 1, file) == 1
+                   && fwrite(binary, 1, length, file) == (size_t)length;
+        if (fclose(file) || !written) {
+            remove(temporary_path);
+        } else if (rename(temporary_path, path)) {
+            // Windows will not rename over an existing file.
+            remove(path);
+            if (rename(temporary_path, path)) remove(temporary_path);
+        }
+    }
+    free(binary);
+}
+
+// Use the simplest possible vertex shader.
+// Every program fragger builds draws the same screen-covering triangles with it.
+char vertex_source[] = "#version 330\n"
+                       "in vec4 vert;\n"
+                       "void main() {\n"
+                       "    gl_Position = vert;\n"
+                       "}\n";
+
+// Attempt to compile a shader.
+// On failure this returns 0 and the info log is copied into message.
+GLuint compile_shader(GLenum type, char * source, char * message, int message_size) {
+    int status = 0;
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, (const char * []) { source }, NULL);
+    glCompileShader(shader);
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE) {
+        glGetShaderInfoLog(shader, message_size, NULL, message);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+// Attempt to create and link a program.
+// On failure this returns 0 and the info log is copied into message.
+GLuint link_program(GLuint vertex_shader, GLuint fragment_shader, char * message, int message_size) {
+    int status = 0;
+    GLuint program = glCreateProgram();
+    if (program_cache.enabled) {
+        program_cache.program_parameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glLinkProgram(program);
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        glGetProgramInfoLog(program, message_size, NULL, message);
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// Build a program for one of fragger's own fragment shaders, which must not fail.
+GLuint create_internal_program(char * fragment_source) {
+    char message[512];
+    GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_source, message, sizeof(message));
+    if (!vertex_shader) panic_exit("Vertex shader compilation failed:\n%s", message);
+    GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fragment_source, message, sizeof(message));
+    if (!fragment_shader) panic_exit("Internal shader compilation failed:\n%s", message);
+    GLuint program = link_program(vertex_shader, fragment_shader, message, sizeof(message));
+    if (!program) panic_exit("Internal shader program link failed:\n%s", message);
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+    return program;
+}
+
+// Two triangles that cover the whole screen.
+// Vertex arrays are not shared between contexts, so each has its own.
+GLuint quad_vertex_array;
+
+GLuint create_fullscreen_quad() {
+    GLuint vertex_array, buffer;
+    GLfloat vertices[6][2] = {
+        { -1.0, -1.0 }, {  1.0, -1.0 }, {  1.0,  1.0 },
+        {  1.0,  1.0 }, { -1.0,  1.0 }, { -1.0, -1.0 }
+    };
+    glGenVertexArrays(1, &vertex_array);
+    glBindVertexArray(vertex_array);
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(0);
+    return vertex_array;
+}
+
+void draw_fullscreen_quad() {
+    glBindVertexArray(quad_vertex_array);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+}
+
+// An offscreen colour buffer that can be rendered into instead of the window.
+// A framebuffer of 0 refers to the window itself, which has no texture.
+typedef struct {
+    GLuint framebuffer;
+    GLuint texture;
+    int width, height;
+} Target;
+
+// Create a framebuffer object with a single texture attached,
+// with the given internal format (such as GL_RGBA8 or GL_R8).
+// The current framebuffer binding is left unchanged.
+Target create_target(int width, int height, GLenum internal_format) {
+    Target target = { 0, 0, width, height };
+    GLint previous_framebuffer;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous_framebuffer);
+    glGenTextures(1, &target.texture);
+    glBindTexture(GL_TEXTURE_2D, target.texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glGenFramebuffers(1, &target.framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.texture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        panic_exit("Could not create a %dx%d framebuffer.", width, height);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, previous_framebuffer);
+    return target;
+}
+
+void destroy_target(Target * target) {
+    if (target->framebuffer) glDeleteFramebuffers(1, &target->framebuffer);
+    if (target->texture) glDeleteTextures(1, &target->texture);
+    memset(target, 0, sizeof(*target));
+}
+
+// Return the time between two performance counter values in seconds.
+double seconds_between(u64 start, u64 end) {
+    return (double)(end - start) / (double)SDL_GetPerformanceFrequency();
+}
+
+// A bounded, thread-safe FIFO of small integers (buffer indices).
+// Pushing to a full queue or popping from an empty one blocks.
+#define QUEUE_CAPACITY 8
+
+typedef struct {
+    int items[QUEUE_CAPACITY];
+    int head, count;
+    SDL_mutex * mutex;
+    SDL_cond * changed;
+} Queue;
+
+void queue_init(Queue * queue) {
+    queue->head = queue->count = 0;
+    queue->mutex = SDL_CreateMutex();
+    queue->changed = SDL_CreateCond();
+}
+
+void queue_push(Queue * queue, int item) {
+    SDL_LockMutex(queue->mutex);
+    while (queue->count == QUEUE_CAPACITY) SDL_CondWait(queue->changed, queue->mutex);
+    queue->items[(queue->head + queue->count++) % QUEUE_CAPACITY] = item;
+    SDL_CondBroadcast(queue->changed);
+    SDL_UnlockMutex(queue->mutex);
+}
+
+// Take the next item. If wait is not set and the queue is empty, return 0
+// immediately instead of blocking.
+int queue_take(Queue * queue, int * item, int wait) {
+    SDL_LockMutex(queue->mutex);
+    while (queue->count == 0 && wait) SDL_CondWait(queue->changed, queue->mutex);
+    int taken = queue->count > 0;
+    if (taken) {
+        *item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % QUEUE_CAPACITY;
+        --queue->count;
+        SDL_CondBroadcast(queue->changed);
+    }
+    SDL_UnlockMutex(queue->mutex);
+    return taken;
+}
+
+int queue_pop(Queue * queue) {
+    int item;
+    queue_take(queue, &item, 1);
+    return item;
+}
+
+// Start a worker thread that uses a shared context. The thread must first
+// call make_context_current and push the result to started, and return
+// straight away if it failed. Returns NULL if the thread could not be
+// started or could not bind the context, in which case the caller does the
+// work on the main thread.
+SDL_Thread * start_context_thread(SDL_ThreadFunction function, char * name, void * data, Queue * started) {
+    SDL_Thread * thread = SDL_CreateThread(function, name, data);
+    if (!thread) return NULL;
+    if (queue_pop(started)) return thread;
+    SDL_WaitThread(thread, NULL);
+    return NULL;
+}
+
+// Image formats that frames can be written as.
+// PPM is read back as RGB, TGA as BGRA (its native order, and usually the
+// fastest readback format), so neither needs swizzling on the CPU.
+// The rest are stream formats: a sequence of frames in a single file.
+// Y4M, I420 and NV12 all store 4:2:0 YUV, and are read back as RGBA unless
+// they are converted on the GPU (see YuvConverter).
+typedef enum { IMAGE_PPM, IMAGE_TGA, IMAGE_RGBA, IMAGE_Y4M, IMAGE_I420, IMAGE_NV12 } ImageFormat;
+
+ImageFormat image_format_for(char * file_name) {
+    char * extension = strrchr(file_name, '.');
+    if (extension && !SDL_strcasecmp(extension, ".tga")) return IMAGE_TGA;
+    if (extension && !SDL_strcasecmp(extension, ".y4m")) return IMAGE_Y4M;
+    if (extension && !SDL_strcasecmp(extension, ".yuv")) return IMAGE_I420;
+    return IMAGE_PPM;
+}
+
+int is_stream_format(ImageFormat format) {
+    return format != IMAGE_PPM && format != IMAGE_TGA;
+}
+
+int is_yuv_format(ImageFormat format) {
+    return format == IMAGE_Y4M || format == IMAGE_I420 || format == IMAGE_NV12;
+}
+
+// The size of a 4:2:0 frame: a full size Y plane and two quarter size chroma planes.
+size_t yuv_frame_size(int width, int height) {
+    return (size_t)width * height + 2 * (size_t)((width + 1) / 2) * ((height + 1) / 2);
+}
+
+// The glReadPixels format and bytes per pixel for an image format.
+GLenum image_gl_format(ImageFormat format) {
+    if (format == IMAGE_TGA) return GL_BGRA;
+    if (format == IMAGE_PPM) return GL_RGB;
+    return GL_RGBA;
+}
+
+int image_pixel_size(ImageFormat format) {
+    return format == IMAGE_PPM ? 3 : 4;
+}
+
+// Write the header of a TGA or PPM file.
+void write_image_header(FILE * file, ImageFormat format, int width, int height) {
+    if (format == IMAGE_TGA) {
+        unsigned char header[18] = { 0 };
+        header[2] = 2; // Uncompressed true-colour.
+        header[12] = width & 0xff; header[13] = width >> 8;
+        header[14] = height & 0xff; header[15] = height >> 8;
+        header[16] = 32; // Bits per pixel.
+        header[17] = 8;  // Alpha bits, with the origin at the bottom left.
+        fwrite(header, 1, sizeof(header), file);
+    } else if (format == IMAGE_PPM) {
+        fprintf(file, "P6\n%d %d\n255\n", width, height);
+    }
+}
+
+// Write an image whose rows are in OpenGL order (bottom row first, tightly packed).
+// TGA stores rows bottom-up anyway, and PPM and raw RGBA rows are simply written
+// in reverse, so the pixels never need to be flipped in memory.
+int write_image(FILE * file, ImageFormat format, int width, int height, unsigned char * pixels) {
+    size_t row_size = (size_t)width * image_pixel_size(format);
+    write_image_header(file, format, width, height);
+    if (format == IMAGE_TGA) {
+        fwrite(pixels, row_size, height, file);
+    } else {
+        for (int y = height - 1; y >= 0; --y) {
+            fwrite(pixels + y * row_size, 1, row_size, file);
+        }
+    }
+    return !ferror(file);
+}
+
+// Convert RGBA rows in OpenGL order to full range BT.601 4:2:0 YUV (as used
+// by Y4M's C420jpeg), top row first. The planes are laid out as I420 (Y, U, V)
+// or NV12 (Y, then interleaved UV) in planes, which holds yuv_frame_size bytes.
+void convert_to_yuv(int width, int height, unsigned char * pixels, unsigned char * planes, int nv12) {
+    int chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+    unsigned char * y_plane = planes;
+    unsigned char * u_plane = y_plane + width * height;
+    unsigned char * v_plane = u_plane + chroma_width * chroma_height;
+    int chroma_step = 1;
+    if (nv12) {
+        v_plane = u_plane + 1;
+        chroma_step = 2;
+    }
+    for (int y = 0; y < height; ++y) {
+        unsigned char * row = pixels + (size_t)(height - 1 - y) * width * 4;
+        for (int x = 0; x < width; ++x) {
+            unsigned char * p = row + x * 4;
+            y_plane[y * width + x] = (77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8;
+        }
+    }
+    // Each chroma sample is the average of a 2x2 block (clamped at odd edges).
+    for (int y = 0; y < chroma_height; ++y) {
+        unsigned char * row0 = pixels + (size_t)(height - 1 - y * 2) * width * 4;
+        unsigned char * row1 = y * 2 + 1 < height ? row0 - (size_t)width * 4 : row0;
+        for (int x = 0; x < chroma_width; ++x) {
+            int x1 = x * 2 + 1 < width ? 4 : 0;
+            unsigned char * a = row0 + x * 8, * b = row1 + x * 8;
+            int r = a[0] + a[x1 + 0] + b[0] + b[x1 + 0];
+            int g = a[1] + a[x1 + 1] + b[1] + b[x1 + 1];
+            int bl = a[2] + a[x1 + 2] + b[2] + b[x1 + 2];
+            int i = (y * chroma_width + x) * chroma_step;
+            u_plane[i] = (-43 * r - 85 * g + 128 * bl + 512 * 256 + 512) >> 10;
+            v_plane[i] = (128 * r - 107 * g - 21 * bl + 512 * 256 + 512) >> 10;
+        }
+    }
+}
+
+// Converts a rendered frame to 4:2:0 YUV on the GPU, so that readback moves
+// 1.5 bytes per pixel instead of 4 and the CPU does no conversion at all.
+// The planes are rendered into one RGBA8 target laid out byte for byte like an
+// I420 or NV12 file (top row first), so glReadPixels returns the file contents
+// directly. Each texel packs four bytes, so a row of the target is one row of
+// the Y plane, two rows of the U or V plane (I420), or one row of UV (NV12).
+// Producing four bytes per fragment keeps the pass cheap on software renderers.
+char yuv_luma_source[] =
+    "#version 330\n"
+    "uniform sampler2D source;\n"
+    "out vec4 frag;\n"
+    "void main() {\n"
+    "    ivec2 p = ivec2(gl_FragCoord.xy);\n"
+    "    int x = p.x * 4, y = textureSize(source, 0).y - 1 - p.y;\n"
+    "    mat4x3 c = mat4x3(texelFetch(source, ivec2(x + 0, y), 0).rgb,\n"
+    "                      texelFetch(source, ivec2(x + 1, y), 0).rgb,\n"
+    "                      texelFetch(source, ivec2(x + 2, y), 0).rgb,\n"
+    "                      texelFetch(source, ivec2(x + 3, y), 0).rgb);\n"
+    "    frag = vec3(0.299, 0.587, 0.114) * c;\n"
+    "}\n";
+
+char yuv_chroma_source[] =
+    "#version 330\n"
+    "uniform sampler2D source;\n"
+    "uniform int nv12;\n"
+    "out vec4 frag;\n"
+    "const vec3 u_weights = vec3(-0.168736, -0.331264, 0.5);\n"
+    "const vec3 v_weights = vec3(0.5, -0.418688, -0.081312);\n"
+    // Sampling between four texels averages the 2x2 block that a chroma sample covers.
+    "vec3 block(int x, int y) {\n"
+    "    vec2 size = vec2(textureSize(source, 0));\n"
+    "    return clamp(texture(source, vec2(x * 2 + 1, size.y - 1.0 - float(y * 2)) / size).rgb, 0.0, 1.0);\n"
+    "}\n"
+    "void main() {\n"
+    "    ivec2 size = textureSize(source, 0);\n"
+    "    ivec2 p = ivec2(gl_FragCoord.xy) - ivec2(0, size.y);\n"
+    "    int x = p.x * 4;\n"
+    "    if (nv12 != 0) {\n"
+    "        vec3 a = block(x / 2, p.y), b = block(x / 2 + 1, p.y);\n"
+    "        frag = vec4(dot(a, u_weights), dot(a, v_weights), dot(b, u_weights), dot(b, v_weights)) + 0.5;\n"
+    "        return;\n"
+    "    }\n"
+    "    int half_width = size.x / 2, plane_rows = size.y / 4;\n"
+    "    bool v = p.y >= plane_rows;\n"
+    "    int row = v ? p.y - plane_rows : p.y;\n"
+    "    int y = row * 2 + int(x >= half_width);\n"
+    "    if (x >= half_width) x -= half_width;\n"
+    "    mat4x3 c = mat4x3(block(x + 0, y), block(x + 1, y), block(x + 2, y), block(x + 3, y));\n"
+    "    frag = (v ? v_weights : u_weights) * c + 0.5;\n"
+    "}\n";
+
+typedef struct {
+    GLuint luma_program, chroma_program;
+    int nv12;
+    // A copy of the window's back buffer, which cannot be sampled directly.
+    Target copy;
+    Target planes;
+} YuvConverter;
+
+void yuv_init(YuvConverter * converter, int width, int height, int nv12) {
+    // Rows of texels must line up with rows of every plane.
+    if (nv12 ? width % 4 || height % 2 : width % 8 || height % 4) {
+        panic_exit("GPU YUV conversion needs the width to be a multiple of %d and the height "
+            "a multiple of %d, not %dx%d.", nv12 ? 4 : 8, nv12 ? 2 : 4, width, height);
+    }
+    converter->luma_program = create_internal_program(yuv_luma_source);
+    converter->chroma_program = create_internal_program(yuv_chroma_source);
+    converter->nv12 = nv12;
+    converter->copy = create_target(width, height, GL_RGBA8);
+    converter->planes = create_target(width / 4, height * 3 / 2, GL_RGBA8);
+}
+
+// Convert source into the planes target, then leave that bound for reading.
+// A source without a texture is the window, and is copied first.
+// The draw framebuffer, viewport and program are left as they were.
+void yuv_convert(YuvConverter * converter, Target * source) {
+    GLint previous_framebuffer, previous_program, previous_viewport[4];
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previous_framebuffer);
+    glGetIntegerv(GL_CURRENT_PROGRAM, &previous_program);
+    glGetIntegerv(GL_VIEWPORT, previous_viewport);
+
+    GLuint texture = source->texture;
+    if (!texture) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, source->framebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, converter->copy.framebuffer);
+        glBlitFramebuffer(0, 0, source->width, source->height, 0, 0, source->width, source->height,
+            GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        texture = converter->copy.texture;
+    }
+
+    // The Y plane fills the first two thirds of the rows, the chroma the rest.
+    int width = converter->planes.width, luma_height = converter->planes.height * 2 / 3;
+    glBindFramebuffer(GL_FRAMEBUFFER, converter->planes.framebuffer);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glViewport(0, 0, width, luma_height);
+    glUseProgram(converter->luma_program);
+    draw_fullscreen_quad();
+    glViewport(0, luma_height, width, luma_height / 2);
+    glUseProgram(converter->chroma_program);
+    glUniform1i(glGetUniformLocation(converter->chroma_program, "nv12"), converter->nv12);
+    draw_fullscreen_quad();
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, previous_framebuffer);
+    glUseProgram(previous_program);
+    glViewport(previous_viewport[0], previous_viewport[1], previous_viewport[2], previous_viewport[3]);
+}
+
+// Take over standard output for binary frame data. Anything that would have
+// been printed to standard output goes to standard error instead.
+// Calling this again returns the same stream.
+FILE * claim_stdout() {
+    static FILE * claimed = NULL;
+    if (claimed) return claimed;
+    fflush(stdout);
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+    int descriptor = _dup(_fileno(stdout));
+    _dup2(_fileno(stderr), _fileno(stdout));
+    claimed = _fdopen(descriptor, "wb");
+#else
+    int descriptor = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    claimed = fdopen(descriptor, "wb");
+#endif
+    return claimed;
+}
+
+// Check that a frame file name pattern contains exactly one integer conversion
+// (such as %d or %05d) and nothing else that printf would interpret.
+int valid_frame_pattern(char * pattern) {
+    int conversions = 0;
+    for (char * c = pattern; *c; ++c) {
+        if (*c != '%') continue;
+        if (c[1] == '%') { ++c; continue; }
+        ++c;
+        while (*c >= '0' && *c <= '9') ++c;
+        if (*c != 'd') return 0;
+        ++conversions;
+    }
+    return conversions == 1;
+}
+
+// Screenshots are read back into a small ring of pixel buffer objects, with a
+// fence after each one. They are written out a frame or two later, once the
+// fence has signalled, so taking one never stalls the frame loop. The file is
+// written straight from the mapped buffer (write_image handles row order).
+#define CAPTURE_BUFFER_COUNT 3
+
+typedef struct {
+    char * pattern;
+    ImageFormat format;
+    GLuint buffers[CAPTURE_BUFFER_COUNT];
+    GLsync fences[CAPTURE_BUFFER_COUNT];
+    int width[CAPTURE_BUFFER_COUNT], height[CAPTURE_BUFFER_COUNT];
+    int frame_index[CAPTURE_BUFFER_COUNT];
+    int next;
+} Capturer;
+
+void capture_init(Capturer * capturer, char * pattern) {
+    if (!valid_frame_pattern(pattern)) {
+        panic_exit("Capture file name '%s' must contain one frame number such as %%05d.", pattern);
+    }
+    memset(capturer, 0, sizeof(*capturer));
+    capturer->pattern = pattern;
+    capturer->format = image_format_for(pattern);
+    glGenBuffers(CAPTURE_BUFFER_COUNT, capturer->buffers);
+}
+
+// Write out a pending capture. Unless wait is set, this does nothing
+// until the GPU has finished with it.
+void capture_complete(Capturer * capturer, int slot, int wait) {
+    if (!capturer->fences[slot]) return;
+    GLenum result = glClientWaitSync(capturer->fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+    if (result == GL_TIMEOUT_EXPIRED && !wait) return;
+    while (result == GL_TIMEOUT_EXPIRED) {
+        result = glClientWaitSync(capturer->fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+    }
+    glDeleteSync(capturer->fences[slot]);
+    capturer->fences[slot] = 0;
+    if (result == GL_WAIT_FAILED) {
+        printf("Capture of frame %d failed.\n", capturer->frame_index[slot]);
+        return;
+    }
+
+    int width = capturer->width[slot], height = capturer->height[slot];
+    size_t size = (size_t)width * height * image_pixel_size(capturer->format);
+    char file_name[1024];
+    snprintf(file_name, sizeof(file_name), capturer->pattern, capturer->frame_index[slot]);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, capturer->buffers[slot]);
+    unsigned char * pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+    FILE * file = pixels ? fopen(file_name, "wb") : NULL;
+    if (file) {
+        int written = write_image(file, capturer->format, width, height, pixels);
+        if (fclose(file) || !written) {
+            printf("Could not write to file '%s'.\n", file_name);
+        } else {
+            printf("Captured frame %d to '%s'.\n", capturer->frame_index[slot], file_name);
+        }
+    } else {
+        printf("Could not capture frame %d to '%s'.\n", capturer->frame_index[slot], file_name);
+    }
+    if (pixels) glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// Start reading back the frame that was just drawn into the bound read framebuffer.
+void capture_frame(Capturer * capturer, int frame_index, int width, int height) {
+    int slot = capturer->next;
+    capturer->next = (slot + 1) % CAPTURE_BUFFER_COUNT;
+    // This only waits if captures are requested faster than the GPU finishes them.
+    capture_complete(capturer, slot, 1);
+
+    capturer->width[slot] = width;
+    capturer->height[slot] = height;
+    capturer->frame_index[slot] = frame_index;
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, capturer->buffers[slot]);
+    glBufferData(GL_PIXEL_PACK_BUFFER, (size_t)width * height * image_pixel_size(capturer->format),
+        NULL, GL_STREAM_READ);
+    glReadPixels(0, 0, width, height, image_gl_format(capturer->format), GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    capturer->fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Write out any captures that have finished, without waiting.
+void capture_poll(Capturer * capturer) {
+    for (int i = 0; i < CAPTURE_BUFFER_COUNT; ++i) capture_complete(capturer, i, 0);
+}
+
+// Wait for and write out all pending captures.
+void capture_finish(Capturer * capturer) {
+    for (int i = 0; i < CAPTURE_BUFFER_COUNT; ++i) capture_complete(capturer, i, 1);
+}
+
+// Exporting renders frames from a fixed timestep and writes them either to
+// numbered image files or to a single stream (a file, named pipe or stdout).
+// The work is split into three stages on separate threads, so that drawing
+// frame N+1, reading back frame N and encoding frame N-1 all overlap:
+//
+//   render (main thread)   draw, then start an asynchronous glReadPixels into a
+//                          pixel buffer object and insert a fence.
+//   readback (GL thread)   wait for the fence on a shared context, map the
+//                          buffer and copy the pixels into a CPU frame.
+//   encode (CPU thread)    write the frame to its file or the stream.
+//
+// Free and filled buffers are passed between the stages through bounded
+// queues, so a slow stage applies back-pressure rather than using more memory.
+// If drop_frames is set, the render stage skips frames instead of waiting.
+#define EXPORT_PIXEL_BUFFER_COUNT 3
+#define EXPORT_FRAME_COUNT 4
+#define EXPORT_DONE -1
+
+typedef struct {
+    char * pattern;
+    ImageFormat format;
+    int width, height;
+    size_t frame_size;
+    FILE * stream;
+    unsigned char * planes;
+    int drop_frames;
+
+    // What is read back: with gpu_yuv set these are the converted planes.
+    int gpu_yuv;
+    int read_width, read_height;
+    GLenum read_format;
+
+    GLuint pixel_buffers[EXPORT_PIXEL_BUFFER_COUNT];
+    GLsync fences[EXPORT_PIXEL_BUFFER_COUNT];
+    int buffer_frame_index[EXPORT_PIXEL_BUFFER_COUNT];
+    Queue free_buffers, filled_buffers;
+
+    unsigned char * frames[EXPORT_FRAME_COUNT];
+    int frame_index[EXPORT_FRAME_COUNT];
+    Queue free_frames, filled_frames;
+
+    SharedContext readback_context;
+    // NULL if frames are read back on the main thread instead.
+    SDL_Thread * readback_thread;
+    Queue readback_started;
+    SDL_Thread * encode_thread;
+
+    // Time spent working (not waiting on a queue) by each stage, in seconds.
+    u64 start_counter;
+    clock_t start_clock;
+    double render_busy, gpu_wait, readback_busy, encode_busy;
+    int frames_submitted, frames_written, frames_dropped;
+} Exporter;
+
+// Copy a filled pixel buffer into a free frame and hand it to the encoder.
+// If wait is not set and the encoder has no free frame, the frame is dropped.
+void export_read_buffer(Exporter * exporter, int buffer, int wait) {
+    // Wait for the GPU to finish rendering and copying this frame.
+    u64 wait_start = SDL_GetPerformanceCounter();
+    GLenum result;
+    do {
+        result = glClientWaitSync(exporter->fences[buffer], 0, 1000000000);
+    } while (result == GL_TIMEOUT_EXPIRED);
+    if (result == GL_WAIT_FAILED) panic_exit("Waiting for an exported frame failed.");
+    glDeleteSync(exporter->fences[buffer]);
+    u64 wait_end = SDL_GetPerformanceCounter();
+    exporter->gpu_wait += seconds_between(wait_start, wait_end);
+
+    int frame;
+    if (!queue_take(&exporter->free_frames, &frame, wait)) {
+        ++exporter->frames_dropped;
+        queue_push(&exporter->free_buffers, buffer);
+        return;
+    }
+
+    u64 copy_start = SDL_GetPerformanceCounter();
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, exporter->pixel_buffers[buffer]);
+    void * pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, exporter->frame_size, GL_MAP_READ_BIT);
+    if (pixels) {
+        memcpy(exporter->frames[frame], pixels, exporter->frame_size);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    } else {
+        // Read the buffer back the slow way rather than lose the frame.
+        glGetBufferSubData(GL_PIXEL_PACK_BUFFER, 0, exporter->frame_size, exporter->frames[frame]);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    exporter->frame_index[frame] = exporter->buffer_frame_index[buffer];
+    exporter->readback_busy += seconds_between(copy_start, SDL_GetPerformanceCounter());
+
+    queue_push(&exporter->free_buffers, buffer);
+    queue_push(&exporter->filled_frames, frame);
+}
+
+int export_readback_thread(void * data) {
+    Exporter * exporter = data;
+    int bound = make_context_current(&exporter->readback_context);
+    queue_push(&exporter->readback_started, bound);
+    if (!bound) return 0;
+    while (1) {
+        int buffer = queue_pop(&exporter->filled_buffers);
+        if (buffer == EXPORT_DONE) break;
+        export_read_buffer(exporter, buffer, 1);
+    }
+    queue_push(&exporter->filled_frames, EXPORT_DONE);
+    make_context_current(NULL);
+    return 0;
+}
+
+int export_encode_thread(void * data) {
+    Exporter * exporter = data;
+    char file_name[1024];
+    while (1) {
+        int frame = queue_pop(&exporter->filled_frames);
+        if (frame == EXPORT_DONE) break;
+
+        u64 encode_start = SDL_GetPerformanceCounter();
+        if (exporter->stream) {
+            FILE * stream = exporter->stream;
+            unsigned char * pixels = exporter->frames[frame];
+            if (exporter->format == IMAGE_Y4M) fputs("FRAME\n", stream);
+            if (exporter->gpu_yuv) {
+                fwrite(pixels, 1, exporter->frame_size, stream);
+            } else if (is_yuv_format(exporter->format)) {
+                convert_to_yuv(exporter->width, exporter->height, pixels,
+                    exporter->planes, exporter->format == IMAGE_NV12);
+                fwrite(exporter->planes, 1, yuv_frame_size(exporter->width, exporter->height), stream);
+            } else {
+                write_image(stream, exporter->format, exporter->width, exporter->height, pixels);
+            }
+            if (ferror(stream)) panic_exit("Could not write to '%s'.", exporter->pattern);
+        } else {
+            snprintf(file_name, sizeof(file_name), exporter->pattern, exporter->frame_index[frame]);
+            FILE * file = fopen(file_name, "wb");
+            if (!file) panic_exit("Could not open file '%s' for writing.", file_name);
+            int written = write_image(file, exporter->format,
+                exporter->width, exporter->height, exporter->frames[frame]);
+            if (fclose(file) || !written) panic_exit("Could not write to file '%s'.", file_name);
+        }
+        ++exporter->frames_written;
+        exporter->encode_busy += seconds_between(encode_start, SDL_GetPerformanceCounter());
+
+        queue_push(&exporter->free_frames, frame);
+    }
+    return 0;
+}
+
+// Allocate the buffers and start the readback and encode threads.
+// For stream formats the destination is a file name ("-" for stdout),
+// otherwise it is a numbered file name pattern. With gpu_yuv set, frames are
+// read back from a YuvConverter's planes rather than as RGBA.
+// Must be called from the main thread with its context current.
+void export_start(Exporter * exporter, char * destination, ImageFormat format,
+                  int width, int height, float frame_rate, int drop_frames, int gpu_yuv) {
+    memset(exporter, 0, sizeof(*exporter));
+    exporter->pattern = destination;
+    exporter->format = format;
+    exporter->width = width;
+    exporter->height = height;
+    exporter->drop_frames = drop_frames;
+    exporter->gpu_yuv = gpu_yuv;
+    if (gpu_yuv) {
+        exporter->read_width = width / 4;
+        exporter->read_height = height * 3 / 2;
+        exporter->read_format = GL_RGBA;
+        exporter->frame_size = yuv_frame_size(width, height);
+    } else {
+        exporter->read_width = width;
+        exporter->read_height = height;
+        exporter->read_format = image_gl_format(format);
+        exporter->frame_size = (size_t)width * height * image_pixel_size(format);
+    }
+
+    if (is_stream_format(format)) {
+#ifndef _WIN32
+        // A consumer that goes away should be reported as a write error.
+        signal(SIGPIPE, SIG_IGN);
+#endif
+        exporter->stream = strcmp(destination, "-") ? fopen(destination, "wb") : claim_stdout();
+        if (!exporter->stream) panic_exit("Could not open '%s' for writing.", destination);
+        // Frames are written whole, so buffer them in large blocks.
+        setvbuf(exporter->stream, NULL, _IOFBF, 1 << 20);
+        if (format == IMAGE_Y4M) {
+            fprintf(exporter->stream, "YUV4MPEG2 W%d H%d F%d:1000 Ip A1:1 C420jpeg\n",
+                width, height, (int)(frame_rate * 1000.0f + 0.5f));
+        }
+        if (is_yuv_format(format) && !gpu_yuv) {
+            exporter->planes = malloc(yuv_frame_size(width, height));
+            if (!exporter->planes) panic_exit("Could not allocate space for YUV frames.");
+        }
+    } else if (!valid_frame_pattern(destination)) {
+        panic_exit("Export file name '%s' must contain one frame number such as %%05d.", destination);
+    }
+
+    queue_init(&exporter->free_buffers);
+    queue_init(&exporter->filled_buffers);
+    queue_init(&exporter->free_frames);
+    queue_init(&exporter->filled_frames);
+    queue_init(&exporter->readback_started);
+
+    glGenBuffers(EXPORT_PIXEL_BUFFER_COUNT, exporter->pixel_buffers);
+    for (int i = 0; i < EXPORT_PIXEL_BUFFER_COUNT; ++i) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, exporter->pixel_buffers[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, exporter->frame_size, NULL, GL_STREAM_READ);
+        queue_push(&exporter->free_buffers, i);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    for (int i = 0; i < EXPORT_FRAME_COUNT; ++i) {
+        exporter->frames[i] = malloc(exporter->frame_size);
+        if (!exporter->frames[i]) panic_exit("Could not allocate space for exported frames.");
+        queue_push(&exporter->free_frames, i);
+    }
+
+    // Without a shared context that this platform will bind on another
+    // thread, the main thread reads frames back itself (see export_frame).
+    exporter->readback_context = create_shared_context();
+    if (exporter->readback_context.context) {
+        exporter->readback_thread = start_context_thread(export_readback_thread, "readback", exporter,
+            &exporter->readback_started);
+    }
+    if (!exporter->readback_thread) {
+        printf("Could not use a shared OpenGL context, so frames are read back on the main thread.\n");
+        destroy_shared_context(&exporter->readback_context);
+    }
+    exporter->encode_thread = SDL_CreateThread(export_encode_thread, "encode", exporter);
+    if (!exporter->encode_thread) panic_exit("Could not start the export thread.\n%s", SDL_GetError());
+    exporter->start_counter = SDL_GetPerformanceCounter();
+    exporter->start_clock = clock();
+}
+
+// Queue an asynchronous readback of the frame that was just drawn into the
+// bound read framebuffer. If every pixel buffer is still in use this blocks,
+// or with drop_frames set, skips the frame.
+// The render stage is timed from draw_start, minus any time spent blocked.
+void export_frame(Exporter * exporter, int frame_index, u64 draw_start) {
+    u64 wait_start = SDL_GetPerformanceCounter();
+    int buffer;
+    if (!exporter->readback_thread) {
+        // Read back the oldest frame once every buffer is in use. With
+        // drop_frames set, it is skipped if the encoder cannot take it.
+        if (!queue_take(&exporter->free_buffers, &buffer, 0)) {
+            export_read_buffer(exporter, queue_pop(&exporter->filled_buffers), !exporter->drop_frames);
+            buffer = queue_pop(&exporter->free_buffers);
+        }
+    } else if (!queue_take(&exporter->free_buffers, &buffer, !exporter->drop_frames)) {
+        ++exporter->frames_dropped;
+        return;
+    }
+    double blocked = seconds_between(wait_start, SDL_GetPerformanceCounter());
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, exporter->pixel_buffers[buffer]);
+    glReadPixels(0, 0, exporter->read_width, exporter->read_height,
+        exporter->read_format, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    exporter->fences[buffer] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    // The readback thread waits on this fence from another context,
+    // so it must actually be submitted.
+    glFlush();
+    exporter->buffer_frame_index[buffer] = frame_index;
+    ++exporter->frames_submitted;
+    exporter->render_busy += seconds_between(draw_start, SDL_GetPerformanceCounter()) - blocked;
+
+    queue_push(&exporter->filled_buffers, buffer);
+}
+
+// Drain the pipeline, stop the threads and print how busy each stage was.
+void export_finish(Exporter * exporter) {
+    if (exporter->readback_thread) {
+        queue_push(&exporter->filled_buffers, EXPORT_DONE);
+        SDL_WaitThread(exporter->readback_thread, NULL);
+        destroy_shared_context(&exporter->readback_context);
+    } else {
+        int buffer;
+        while (queue_take(&exporter->filled_buffers, &buffer, 0)) export_read_buffer(exporter, buffer, 1);
+        queue_push(&exporter->filled_frames, EXPORT_DONE);
+    }
+    SDL_WaitThread(exporter->encode_thread, NULL);
+    double total = seconds_between(exporter->start_counter, SDL_GetPerformanceCounter());
+    double cpu_time = (double)(clock() - exporter->start_clock) / CLOCKS_PER_SEC;
+
+    glDeleteBuffers(EXPORT_PIXEL_BUFFER_COUNT, exporter->pixel_buffers);
+    for (int i = 0; i < EXPORT_FRAME_COUNT; ++i) free(exporter->frames[i]);
+    if (exporter->stream && fclose(exporter->stream)) {
+        panic_exit("Could not write to '%s'.", exporter->pattern);
+    }
+    free(exporter->planes);
+
+    printf("Exported %d frames in %.3f s (%.1f frames per second).\n",
+        exporter->frames_written, total, exporter->frames_written / total);
+    if (exporter->frames_dropped) {
+        printf("Dropped %d frames because the output could not keep up.\n", exporter->frames_dropped);
+    }
+    // Process CPU time covers every thread, including any in the driver.
+    printf("CPU time: %.3f s (%.3f ms per frame), reading back %.1f bytes per pixel.\n",
+        cpu_time, cpu_time * 1000.0 / exporter->frames_written,
+        (double)exporter->frame_size / ((double)exporter->width * exporter->height));
+    printf("Stage      Busy (s)  Utilisation\n");
+    printf("render     %8.3f  %10.1f%%\n", exporter->render_busy, 100.0 * exporter->render_busy / total);
+    printf("gpu wait   %8.3f  %10.1f%%\n", exporter->gpu_wait, 100.0 * exporter->gpu_wait / total);
+    printf("readback   %8.3f  %10.1f%%\n", exporter->readback_busy, 100.0 * exporter->readback_busy / total);
+    printf("encode     %8.3f  %10.1f%%\n", exporter->encode_busy, 100.0 * exporter->encode_busy / total);
+}
+
+// Compare two doubles, for qsort.
+int compare_doubles(const void * a, const void * b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Get the value below which p percent of a sorted array falls (nearest rank).
+double percentile(double * sorted, int count, double p) {
+    if (count == 0) return 0.0;
+    int rank = (int)(p / 100.0 * count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+// Profiling measures how long the GPU spends drawing each frame, using a ring
+// of GL_TIME_ELAPSED queries. A query's result is only read once it is
+// available (a few frames later), so profiling never stalls the pipeline. If
+// every query is still in flight, the frame is simply not measured.
+#define PROFILE_QUERY_COUNT 4
+#define PROFILE_WINDOW 240
+#define PROFILE_REPORT_INTERVAL 1.0
+
+typedef struct {
+    GLuint queries[PROFILE_QUERY_COUNT];
+    int query_frame[PROFILE_QUERY_COUNT];
+    double query_frame_time[PROFILE_QUERY_COUNT];
+    int pending[PROFILE_QUERY_COUNT];
+    int next, active;
+
+    // The most recent GPU times in milliseconds, for the rolling statistics.
+    double window[PROFILE_WINDOW];
+    int window_count, window_next;
+    int frames_unmeasured;
+
+    // The most recent result, and which frame it was for.
+    double last_milliseconds;
+    int last_frame;
+    // Do not print the rolling statistics.
+    int quiet;
+
+    FILE * csv;
+    u64 start, last_frame_start, last_report;
+} Profiler;
+
+void profile_init(Profiler * profiler, char * csv_file_name) {
+    memset(profiler, 0, sizeof(*profiler));
+    profiler->last_frame = -1;
+    glGenQueries(PROFILE_QUERY_COUNT, profiler->queries);
+    if (csv_file_name) {
+        profiler->csv = fopen(csv_file_name, "w");
+        if (!profiler->csv) panic_exit("Could not open file '%s' for writing.", csv_file_name);
+        fprintf(profiler->csv, "frame,gpu_ms,frame_ms\n");
+    }
+    profiler->start = profiler->last_report = SDL_GetPerformanceCounter();
+}
+
+// Print the minimum, median and 99th percentile of the recent GPU times.
+void profile_report(Profiler * profiler) {
+    double sorted[PROFILE_WINDOW];
+    int count = profiler->window_count;
+    memcpy(sorted, profiler->window, count * sizeof(double));
+    qsort(sorted, count, sizeof(double), compare_doubles);
+    printf("GPU: min %.3f ms, median %.3f ms, p99 %.3f ms (last %d frames",
+        percentile(sorted, count, 0.0), percentile(sorted, count, 50.0),
+        percentile(sorted, count, 99.0), count);
+    if (profiler->frames_unmeasured) printf(", %d unmeasured", profiler->frames_unmeasured);
+    printf(")\n");
+}
+
+// Read back any finished queries without waiting (or waiting, if wait is set).
+void profile_poll(Profiler * profiler, int wait) {
+    for (int i = 0; i < PROFILE_QUERY_COUNT; ++i) {
+        // Results are collected oldest first.
+        int slot = (profiler->next + i) % PROFILE_QUERY_COUNT;
+        if (!profiler->pending[slot]) continue;
+        GLint available = 0;
+        glGetQueryObjectiv(profiler->queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available && !wait) break;
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(profiler->queries[slot], GL_QUERY_RESULT, &nanoseconds);
+        profiler->pending[slot] = 0;
+
+        // Some drivers report garbage for the first queries of a context.
+        // No frame can take longer than profiling has been running.
+        double milliseconds = nanoseconds / 1000000.0;
+        if (milliseconds > seconds_between(profiler->start, SDL_GetPerformanceCounter()) * 1000.0) {
+            ++profiler->frames_unmeasured;
+            continue;
+        }
+        profiler->last_milliseconds = milliseconds;
+        profiler->last_frame = profiler->query_frame[slot];
+        profiler->window[profiler->window_next] = milliseconds;
+        profiler->window_next = (profiler->window_next + 1) % PROFILE_WINDOW;
+        if (profiler->window_count < PROFILE_WINDOW) ++profiler->window_count;
+        if (profiler->csv) {
+            fprintf(profiler->csv, "%d,%.4f,%.4f\n", profiler->query_frame[slot],
+                milliseconds, profiler->query_frame_time[slot]);
+        }
+    }
+
+    u64 now = SDL_GetPerformanceCounter();
+    if (seconds_between(profiler->last_report, now) >= PROFILE_REPORT_INTERVAL
+     && profiler->window_count && !profiler->quiet) {
+        profile_report(profiler);
+        profiler->last_report = now;
+    }
+}
+
+// Start timing the GPU work of a frame.
+void profile_begin(Profiler * profiler, int frame_index) {
+    u64 now = SDL_GetPerformanceCounter();
+    double frame_time = profiler->last_frame_start
+        ? seconds_between(profiler->last_frame_start, now) * 1000.0 : 0.0;
+    profiler->last_frame_start = now;
+
+    int slot = profiler->next;
+    if (profiler->pending[slot]) {
+        ++profiler->frames_unmeasured;
+        profiler->active = 0;
+        return;
+    }
+    profiler->query_frame[slot] = frame_index;
+    profiler->query_frame_time[slot] = frame_time;
+    glBeginQuery(GL_TIME_ELAPSED, profiler->queries[slot]);
+    profiler->active = 1;
+}
+
+void profile_end(Profiler * profiler) {
+    if (!profiler->active) return;
+    glEndQuery(GL_TIME_ELAPSED);
+    profiler->pending[profiler->next] = 1;
+    profiler->next = (profiler->next + 1) % PROFILE_QUERY_COUNT;
+    profiler->active = 0;
+}
+
+// Collect the remaining results, print the final statistics and close the CSV.
+void profile_finish(Profiler * profiler) {
+    profile_poll(profiler, 1);
+    if (profiler->window_count && !profiler->quiet) profile_report(profiler);
+    if (profiler->csv && fclose(profiler->csv)) panic_exit("Could not write the profile CSV.");
+    profiler->csv = NULL;
+}
+
+// A growable array of per-frame measurements, in milliseconds.
+typedef struct {
+    double * values;
+    int count, capacity;
+} Samples;
+
+void samples_add(Samples * samples, double value) {
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 256;
+        samples->values = realloc(samples->values, samples->capacity * sizeof(double));
+        if (!samples->values) panic_exit("Could not allocate space for benchmark samples.");
+    }
+    samples->values[samples->count++] = value;
+}
+
+// Summary statistics of a set of samples.
+typedef struct {
+    double mean, min, p50, p95, p99, max;
+} Stats;
+
+Stats summarise(Samples * samples) {
+    Stats stats = { 0 };
+    int count = samples->count;
+    if (!count) return stats;
+    double * sorted = malloc(count * sizeof(double));
+    if (!sorted) panic_exit("Could not allocate space for benchmark samples.");
+    memcpy(sorted, samples->values, count * sizeof(double));
+    qsort(sorted, count, sizeof(double), compare_doubles);
+    for (int i = 0; i < count; ++i) stats.mean += sorted[i];
+    stats.mean /= count;
+    stats.min = sorted[0];
+    stats.p50 = percentile(sorted, count, 50.0);
+    stats.p95 = percentile(sorted, count, 95.0);
+    stats.p99 = percentile(sorted, count, 99.0);
+    stats.max = sorted[count - 1];
+    free(sorted);
+    return stats;
+}
+
+// Write a string as a JSON string literal.
+void write_json_string(FILE * file, const char * string) {
+    fputc('"', file);
+    for (const unsigned char * c = (const unsigned char *)string; c && *c; ++c) {
+        if (*c == '"' || *c == '\\') fprintf(file, "\\%c", *c);
+        else if (*c < 0x20) fprintf(file, "\\u%04x", *c);
+        else fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+void write_json_stats(FILE * file, char * name, Stats stats, int last) {
+    fprintf(file, "  \"%s\": { \"mean\": %.4f, \"min\": %.4f, \"p50\": %.4f, "
+                  "\"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f }%s\n",
+        name, stats.mean, stats.min, stats.p50, stats.p95, stats.p99, stats.max, last ? "" : ",");
+}
+
+// Benchmarking renders a fixed workload as fast as possible: no vsync, no sleep,
+// and time, mouse and random follow the same sequence on every run. Each frame
+// is finished (glFinish) before the next one starts, so frame times measure the
+// shader rather than how deeply the driver queues. Warm-up frames (shader
+// compilation, caches, clock ramp-up) are rendered but not measured.
+typedef struct {
+    int warmup_frames;
+    double duration;
+    Samples frame_ms, cpu_ms, gpu_ms;
+    int frames_unmeasured;
+    u64 measure_start;
+} Bench;
+
+// The mouse position for a benchmark frame: a slow circle around the centre.
+void bench_mouse(int frame_index, float frame_rate, int width, int height, float * x, float * y) {
+    float angle = frame_index / frame_rate;
+    *x = width * (0.5f + 0.25f * cosf(angle));
+    *y = height * (0.5f + 0.25f * sinf(angle));
+}
+
+// Record one finished frame. Returns 0 once a duration limit has been reached.
+int bench_frame(Bench * bench, int frame_index, double frame_ms, double cpu_ms, double gpu_ms) {
+    if (frame_index < bench->warmup_frames) return 1;
+    if (frame_index == bench->warmup_frames) bench->measure_start = SDL_GetPerformanceCounter();
+    samples_add(&bench->frame_ms, frame_ms);
+    samples_add(&bench->cpu_ms, cpu_ms);
+    if (gpu_ms >= 0.0) samples_add(&bench->gpu_ms, gpu_ms); else ++bench->frames_unmeasured;
+    return !bench->duration
+        || seconds_between(bench->measure_start, SDL_GetPerformanceCounter()) < bench->duration;
+}
+
+// Write the JSON benchmark report.
+void bench_report(Bench * bench, FILE * file, char * shader, int width, int height, int headless) {
+    fprintf(file, "{\n  \"shader\": ");
+    write_json_string(file, shader);
+    fprintf(file, ",\n  \"width\": %d,\n  \"height\": %d,\n  \"headless\": %s,\n",
+        width, height, headless ? "true" : "false");
+    fprintf(file, "  \"warmup_frames\": %d,\n  \"frames\": %d,\n  \"gpu_frames_unmeasured\": %d,\n",
+        bench->warmup_frames, bench->frame_ms.count, bench->frames_unmeasured);
+    fprintf(file, "  \"vendor\": ");
+    write_json_string(file, (const char *)glGetString(GL_VENDOR));
+    fprintf(file, ",\n  \"renderer\": ");
+    write_json_string(file, (const char *)glGetString(GL_RENDERER));
+    fprintf(file, ",\n  \"version\": ");
+    write_json_string(file, (const char *)glGetString(GL_VERSION));
+    fprintf(file, ",\n");
+    write_json_stats(file, "frame_ms", summarise(&bench->frame_ms), 0);
+    write_json_stats(file, "cpu_ms", summarise(&bench->cpu_ms), 0);
+    write_json_stats(file, "gpu_ms", summarise(&bench->gpu_ms), 1);
+    fprintf(file, "}\n");
+}
+
+// Read a number from a JSON benchmark report, such as the p50 of "frame_ms".
+// This only understands reports written by bench_report.
+int read_report_value(char * report, char * object, char * key, double * value) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\"", object);
+    char * found = strstr(report, pattern);
+    if (!found) return 0;
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    found = strstr(found, pattern);
+    return found && sscanf(found + strlen(pattern), "%lf", value) == 1;
+}
+
+// Read a whole file into a new null terminated buffer, or return NULL.
+char * read_file(char * file_name) {
+    FILE * file = fopen(file_name, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    rewind(file);
+    char * contents = calloc(length + 1, 1);
+    if (contents && length && fread(contents, 1, length, file) != (size_t)length) {
+        free(contents);
+        contents = NULL;
+    }
+    fclose(file);
+    return contents;
+}
+
+int compare_strings(const void * a, const void * b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// A benchmark suite runs every .glsl file in a directory through --bench in
+// its own headless process (so a shader that fails cannot take the suite down)
+// with identical settings, and compares each median frame time with a baseline
+// file. Shaders that got slower by more than the threshold are flagged, and
+// the exit status is non-zero if any regressed or failed, for use in CI.
+//
+// The baseline is a text file with one "name p50_ms p99_ms" line per shader.
+// It is created if it does not exist, and rewritten if update is set.
+typedef struct {
+    char * directory;
+    char * baseline_file_name;
+    float threshold;
+    int update;
+    int width, height;
+    int frames, warmup_frames;
+} Suite;
+
+// Run a program (found on the PATH, if its name has no directory) with a
+// NULL-terminated argument list, without a shell in between to interpret the
+// arguments. Returns its exit status, or -1 if it could not be run.
+int run_process(char ** arguments) {
+#ifdef _WIN32
+    // _spawnvp joins the arguments with spaces, so quote each one. Windows
+    // file names cannot contain quotes.
+    char quoted[16][1100];
+    char * quoted_arguments[17];
+    int count = 0;
+    for (; arguments[count] && count < 16; ++count) {
+        snprintf(quoted[count], sizeof(quoted[count]), "\"%s\"", arguments[count]);
+        quoted_arguments[count] = quoted[count];
+    }
+    quoted_arguments[count] = NULL;
+    return (int)_spawnvp(_P_WAIT, arguments[0], (const char * const *)quoted_arguments);
+#else
+    pid_t child = fork();
+    if (child < 0) return -1;
+    if (child == 0) {
+        execvp(arguments[0], arguments);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(child, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+}
+
+int run_suite(Suite * suite, char * program) {
+    DIR * directory = opendir(suite->directory);
+    if (!directory) panic_exit("Could not open directory '%s'.", suite->directory);
+    char ** names = NULL;
+    int name_count = 0;
+    struct dirent * entry;
+    while ((entry = readdir(directory))) {
+        size_t length = strlen(entry->d_name);
+        if (length < 5 || SDL_strcasecmp(entry->d_name + length - 5, ".glsl")) continue;
+        names = realloc(names, (name_count + 1) * sizeof(char *));
+        if (!names) panic_exit("Could not allocate space for the suite.");
+        names[name_count++] = SDL_strdup(entry->d_name);
+    }
+    closedir(directory);
+    if (!name_count) panic_exit("No .glsl files found in '%s'.", suite->directory);
+    qsort(names, name_count, sizeof(char *), compare_strings);
+
+    // Load the baseline, if there is one. Its first line records the settings,
+    // and comparing runs made with different settings would be meaningless.
+    char settings[256];
+    snprintf(settings, sizeof(settings),
+        "# fragger benchmark baseline: %dx%d, %d frames after %d warm-up frames\n",
+        suite->width, suite->height, suite->frames, suite->warmup_frames);
+    char * baseline = read_file(suite->baseline_file_name);
+    if (baseline && strncmp(baseline, settings, strlen(settings))) {
+        printf("Warning: the baseline was recorded with different settings.\n");
+    }
+    FILE * output = NULL;
+    if (suite->update || !baseline) {
+        output = fopen(suite->baseline_file_name, "w");
+        if (!output) panic_exit("Could not open file '%s' for writing.", suite->baseline_file_name);
+        fprintf(output, "%s# shader p50_ms p99_ms\n", settings);
+    }
+
+    char report_file_name[1024];
+    snprintf(report_file_name, sizeof(report_file_name), "%s.report.json", suite->baseline_file_name);
+
+    printf("%-32s %12s %12s %9s\n", "Shader", "Baseline", "Median", "Change");
+    int regressed = 0, failed = 0;
+    char * renderer = NULL;
+    for (int i = 0; i < name_count; ++i) {
+        char path[1024], size[32], frames[16], warmup[16];
+        snprintf(path, sizeof(path), "%s/%s", suite->directory, names[i]);
+        snprintf(size, sizeof(size), "%dx%d", suite->width, suite->height);
+        snprintf(frames, sizeof(frames), "%d", suite->frames);
+        snprintf(warmup, sizeof(warmup), "%d", suite->warmup_frames);
+        char * arguments[] = { program, "--headless", size, "--bench", "--frames", frames,
+            "--warmup", warmup, "--report", report_file_name, path, NULL };
+        remove(report_file_name);
+        fflush(stdout);
+
+        double median = 0.0, p99 = 0.0;
+        char * report = run_process(arguments) == 0 ? read_file(report_file_name) : NULL;
+        if (!report
+         || !read_report_value(report, "frame_ms", "p50", &median)
+         || !read_report_value(report, "frame_ms", "p99", &p99)) {
+            printf("%-32s %12s %12s %9s  FAILED\n", names[i], "", "", "");
+            ++failed;
+            free(report);
+            continue;
+        }
+        if (!renderer) {
+            char * found = strstr(report, "\"renderer\": \"");
+            if (found) {
+                renderer = SDL_strdup(found + 13);
+                renderer[strcspn(renderer, "\"")] = '\0';
+            }
+        }
+        free(report);
+        if (output) fprintf(output, "%s %.4f %.4f\n", names[i], median, p99);
+
+        // Find this shader's line in the baseline.
+        double baseline_median = 0.0;
+        int in_baseline = 0;
+        for (char * line = baseline; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : "") {
+            size_t length = strlen(names[i]);
+            if (!strncmp(line, names[i], length) && line[length] == ' ') {
+                in_baseline = sscanf(line + length, "%lf", &baseline_median) == 1;
+                break;
+            }
+        }
+
+        if (!in_baseline || baseline_median <= 0.0) {
+            printf("%-32s %12s %9.3f ms %9s  new\n", names[i], "", median, "");
+            continue;
+        }
+        double change = (median - baseline_median) / baseline_median * 100.0;
+        int is_regression = change > suite->threshold;
+        printf("%-32s %9.3f ms %9.3f ms %+8.1f%%%s\n", names[i], baseline_median, median, change,
+            is_regression ? "  REGRESSED" : change < -suite->threshold ? "  improved" : "");
+        regressed += is_regression;
+    }
+    remove(report_file_name);
+
+    if (renderer) printf("\nRenderer: %s\n", renderer);
+    printf("%d shaders, %d regressed by more than %.1f%%, %d failed.\n",
+        name_count, regressed, suite->threshold, failed);
+    if (output) {
+        if (fclose(output)) panic_exit("Could not write to file '%s'.", suite->baseline_file_name);
+        printf("Baseline written to '%s'.\n", suite->baseline_file_name);
+    }
+
+    for (int i = 0; i < name_count; ++i) SDL_free(names[i]);
+    free(names);
+    free(baseline);
+    SDL_free(renderer);
+    return regressed || failed;
+}
+
+// Modes that draw a frame in tiles, or take samples within pixels, move
+// gl_FragCoord by a uniform, so that shaders need no changes. The uniform and
+// a macro replacing gl_FragCoord are inserted after the #version line (and
+// any #extension lines), followed by a #line directive so that error messages
+// still give the line numbers of the file.
+#define UNIFORM_FRAGCOORD_OFFSET "fragger_offset"
+
+int fragcoord_offset_enabled;
+
+// Returns a new source with the offset inserted, and frees the old one.
+char * insert_fragcoord_offset(char * source) {
+    char * insert_at = source;
+    int line = 1;
+    for (char * at = source; *at; ) {
+        char * end = at + strcspn(at, "\n");
+        char * text = at + strspn(at, " \t");
+        int is_version = !strncmp(text, "#version", 8);
+        int is_extension = !strncmp(text, "#extension", 10);
+        at = *end ? end + 1 : end;
+        if (is_version || is_extension) {
+            insert_at = at;
+            line = 1;
+            for (char * c = source; c < at; ++c) line += *c == '\n';
+        }
+    }
+    char prelude[256];
+    int prelude_length = snprintf(prelude, sizeof(prelude),
+        "%suniform vec2 " UNIFORM_FRAGCOORD_OFFSET ";\n"
+        "#define gl_FragCoord (gl_FragCoord + vec4(" UNIFORM_FRAGCOORD_OFFSET ", 0.0, 0.0))\n"
+        "#line %d\n", insert_at > source && insert_at[-1] != '\n' ? "\n" : "", line);
+    size_t length = strlen(source);
+    char * result = malloc(length + prelude_length + 1);
+    if (!result) panic_exit("Could not allocate space for a shader.");
+    size_t head = insert_at - source;
+    memcpy(result, source, head);
+    memcpy(result + head, prelude, prelude_length);
+    memcpy(result + head + prelude_length, insert_at, length - head + 1);
+    free(source);
+    return result;
+}
+
+// Read, compile and link a fragment shader file into a program for the
+// screen-covering triangles, or load it from the program cache. On failure
+// this returns 0 and a description of the problem is written into message.
+GLuint build_program(char * file_name, char * message, int message_size) {
+    char log[4096];
+    char * source = read_file(file_name);
+    if (!source) {
+        snprintf(message, message_size, "Could not read file '%s'.", file_name);
+        return 0;
+    }
+    if (fragcoord_offset_enabled) source = insert_fragcoord_offset(source);
+    u64 key = program_cache_key(vertex_source, source);
+    GLuint cached = program_cache_load(key);
+    if (cached) {
+        free(source);
+        return cached;
+    }
+    GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_source, log, sizeof(log));
+    if (!vertex_shader) panic_exit("Vertex shader compilation failed:\n%s", log);
+    GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, source, log, sizeof(log));
+    free(source);
+    if (!fragment_shader) {
+        snprintf(message, message_size, "Fragment shader ('%s') compilation failed:\n%s", file_name, log);
+        glDeleteShader(vertex_shader);
+        return 0;
+    }
+    GLuint program = link_program(vertex_shader, fragment_shader, log, sizeof(log));
+    if (program) {
+        program_cache_store(key, program);
+    } else {
+        snprintf(message, message_size, "Shader program link failed:\n%s", log);
+    }
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+    return program;
+}
+
+// The values of the built-in uniforms for the current frame.
+typedef struct {
+    float width, height;
+    float mouse_x, mouse_y;
+    float time, delta;
+    int frame;
+    float random, button;
+    // Year, month (1 to 12), day (1 to 31) and seconds since midnight.
+    float date[4];
+    // Added to gl_FragCoord, when that is enabled.
+    float offset_x, offset_y;
+} UniformValues;
+
+// The uniform buffer binding point of the built-in uniform block.
+#define UNIFORM_BLOCK_BINDING 0
+
+// The locations of the built-in uniforms in a program, and the values last
+// given to them. Any that the shader does not use are -1, and are skipped.
+typedef struct {
+    int resolution, mouse, time, delta, frame, random, button, date, offset;
+    UniformValues sent;
+    int has_sent;
+} Uniforms;
+
+Uniforms find_uniforms(GLuint program) {
+    Uniforms uniforms = { 0 };
+    uniforms.resolution = glGetUniformLocation(program, UNIFORM_RESOLUTION);
+    uniforms.mouse      = glGetUniformLocation(program, UNIFORM_MOUSE);
+    uniforms.time       = glGetUniformLocation(program, UNIFORM_TIME);
+    uniforms.delta      = glGetUniformLocation(program, UNIFORM_DELTA);
+    uniforms.frame      = glGetUniformLocation(program, UNIFORM_FRAME);
+    uniforms.random     = glGetUniformLocation(program, UNIFORM_RANDOM);
+    uniforms.button     = glGetUniformLocation(program, UNIFORM_BUTTON);
+    uniforms.date       = glGetUniformLocation(program, UNIFORM_DATE);
+    uniforms.offset     = glGetUniformLocation(program, UNIFORM_FRAGCOORD_OFFSET);
+
+    // Shaders may instead read the built-ins from the uniform block.
+    GLuint block = glGetUniformBlockIndex(program, UNIFORM_BLOCK);
+    if (block != GL_INVALID_INDEX) glUniformBlockBinding(program, block, UNIFORM_BLOCK_BINDING);
+    return uniforms;
+}
+
+// Returns 1 if a program reads any built-in uniform that changes by itself
+// from frame to frame, rather than only on input. The members of the uniform
+// block are listed as active uniforms too, but std140 keeps all of them
+// active, so a shader that declares the block always counts as animated.
+int uses_changing_uniforms(GLuint program) {
+    static char * changing[] = {
+        UNIFORM_TIME, UNIFORM_DELTA, UNIFORM_FRAME, UNIFORM_RANDOM, UNIFORM_BUTTON, UNIFORM_DATE
+    };
+    int count = 0;
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+    for (int i = 0; i < count; ++i) {
+        char name[256];
+        GLint size;
+        GLenum type;
+        glGetActiveUniform(program, i, sizeof(name), NULL, &size, &type, name);
+        for (int j = 0; j < (int)(sizeof(changing) / sizeof(changing[0])); ++j) {
+            if (!strcmp(name, changing[j])) return 1;
+        }
+    }
+    return 0;
+}
+
+// Set the plain built-in uniforms of the current program that it uses and
+// whose values have changed since it was last drawn.
+void set_uniforms(Uniforms * uniforms, UniformValues * values) {
+    UniformValues * sent = &uniforms->sent;
+    int all = !uniforms->has_sent;
+    if (uniforms->resolution != -1 && (all || sent->width != values->width || sent->height != values->height)) {
+        glUniform2f(uniforms->resolution, values->width, values->height);
+    }
+    if (uniforms->mouse != -1 && (all || sent->mouse_x != values->mouse_x || sent->mouse_y != values->mouse_y)) {
+        glUniform2f(uniforms->mouse, values->mouse_x, values->mouse_y);
+    }
+    if (uniforms->time != -1 && (all || sent->time != values->time)) {
+        glUniform1f(uniforms->time, values->time);
+    }
+    if (uniforms->delta != -1 && (all || sent->delta != values->delta)) {
+        glUniform1f(uniforms->delta, values->delta);
+    }
+    if (uniforms->frame != -1 && (all || sent->frame != values->frame)) {
+        glUniform1i(uniforms->frame, values->frame);
+    }
+    if (uniforms->random != -1 && (all || sent->random != values->random)) {
+        glUniform1f(uniforms->random, values->random);
+    }
+    if (uniforms->button != -1 && (all || sent->button != values->button)) {
+        glUniform1f(uniforms->button, values->button);
+    }
+    if (uniforms->date != -1 && (all || memcmp(sent->date, values->date, sizeof(values->date)))) {
+        glUniform4fv(uniforms->date, 1, values->date);
+    }
+    if (uniforms->offset != -1 && (all || sent->offset_x != values->offset_x || sent->offset_y != values->offset_y)) {
+        glUniform2f(uniforms->offset, values->offset_x, values->offset_y);
+    }
+    *sent = *values;
+    uniforms->has_sent = 1;
+}
+
+// The built-ins are also available as a std140 uniform block, which every
+// program shares through one buffer. Shaders declare it as:
+//
+//     layout(std140) uniform Fragger {
+//         vec4 date;
+//         vec2 resolution;
+//         vec2 mouse;
+//         float time;
+//         float delta;
+//         int frame;
+//         float random;
+//         float button;
+//     };
+//
+// The buffer is updated with a single glBufferSubData per frame, and only if
+// a value changed.
+typedef struct {
+    float date[4];
+    float resolution[2];
+    float mouse[2];
+    float time, delta;
+    int frame;
+    float random, button;
+    float padding[3];
+} UniformBlockData;
+
+typedef struct {
+    GLuint buffer;
+    UniformBlockData sent;
+} UniformBlock;
+
+void uniform_block_init(UniformBlock * block) {
+    memset(block, 0, sizeof(*block));
+    glGenBuffers(1, &block->buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, block->buffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(UniformBlockData), &block->sent, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, UNIFORM_BLOCK_BINDING, block->buffer);
+}
+
+void uniform_block_update(UniformBlock * block, UniformValues * values) {
+    UniformBlockData data = { 0 };
+    memcpy(data.date, values->date, sizeof(data.date));
+    data.resolution[0] = values->width;
+    data.resolution[1] = values->height;
+    data.mouse[0] = values->mouse_x;
+    data.mouse[1] = values->mouse_y;
+    data.time = values->time;
+    data.delta = values->delta;
+    data.frame = values->frame;
+    data.random = values->random;
+    data.button = values->button;
+    if (!memcmp(&data, &block->sent, sizeof(data))) return;
+    glBindBuffer(GL_UNIFORM_BUFFER, block->buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(data), &data);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    block->sent = data;
+}
+
+// Fill in the date uniform for a moment some seconds after start.
+void get_date(time_t start, double seconds, float date[4]) {
+    time_t now = start + (time_t)seconds;
+    struct tm * local = localtime(&now);
+    date[0] = local->tm_year + 1900;
+    date[1] = local->tm_mon + 1;
+    date[2] = local->tm_mday;
+    date[3] = local->tm_hour * 3600 + local->tm_min * 60 + local->tm_sec + (seconds - (time_t)seconds);
+}
+
+// A pipeline is the main shader plus any number of named passes, declared in
+// the main shader with lines like:
+//
+//     #pragma fragger pass blur blur.glsl
+//
+// Each pass is a fragment shader (its file is relative to the main shader)
+// rendered into an offscreen texture the size of the output. Any shader can
+// read a pass by declaring a sampler with its name, such as
+// "uniform sampler2D blur;", and a pass that reads itself gets its previous
+// frame. Passes are drawn in dependency order, then the main shader is drawn
+// to the output. Only passes that read themselves have two textures, which
+// swap every frame; reading each other in a cycle is an error.
+//
+// The main shader can read its own previous frame in the same way, through a
+// sampler named "backbuffer". It is then drawn into a pair of textures too,
+// and the new frame is blitted to the output.
+#define PASS_LIMIT 8
+#define UNIFORM_BACKBUFFER "backbuffer"
+
+// Texture units: each pass uses the one matching its index, followed by the
+// backbuffer and then the image channels.
+#define BACKBUFFER_UNIT PASS_LIMIT
+#define CHANNEL_UNIT (PASS_LIMIT + 1)
+#define CHANNEL_COUNT 4
+
+typedef struct {
+    // The main shader has no name, and is always the last pass.
+    char name[64];
+    char file_name[1024];
+    GLuint program;
+    Uniforms uniforms;
+    // This pass's sampler location for each pass, or -1 if it does not read it.
+    int samplers[PASS_LIMIT];
+    // Set if this pass reads its own previous frame.
+    int feedback;
+    // With feedback, targets[current] holds the latest frame.
+    Target targets[2];
+    int current;
+} Pass;
+
+typedef struct {
+    Pass passes[PASS_LIMIT + 1];
+    int pass_count;
+    // Pass indices in the order they are drawn. The main shader is last.
+    int order[PASS_LIMIT + 1];
+    // Set if drawing twice with the same input can give a different image.
+    int animated;
+} Pipeline;
+
+// Offscreen passes are stored with half-float precision, so that simulations
+// can keep values outside 0 to 1 between frames.
+#define PASS_FORMAT GL_RGBA16F
+
+void destroy_pipeline(Pipeline * pipeline) {
+    for (int i = 0; i < pipeline->pass_count; ++i) {
+        Pass * pass = &pipeline->passes[i];
+        if (pass->program) glDeleteProgram(pass->program);
+        for (int t = 0; t < 2; ++t) destroy_target(&pass->targets[t]);
+    }
+    pipeline->pass_count = 0;
+}
+
+// Find the pass declarations in the main shader's source.
+int parse_passes(Pipeline * pipeline, char * file_name, char * source, char * message, int message_size) {
+    // Pass files are relative to the directory of the main shader.
+    int directory_length = 0;
+    for (int i = 0; file_name[i]; ++i) {
+        if (file_name[i] == '/' || file_name[i] == '\\') directory_length = i + 1;
+    }
+
+    for (char * line = source; *line; ) {
+        size_t length = strcspn(line, "\n");
+        char text[1200], name[256], pass_file[1024];
+        snprintf(text, sizeof(text), "%.*s", (int)(length < sizeof(text) - 1 ? length : sizeof(text) - 1), line);
+        line += length + (line[length] == '\n');
+        if (sscanf(text, " #pragma fragger pass %255s %1023s", name, pass_file) != 2) continue;
+
+        // The name must be usable as a GLSL identifier.
+        int valid = strlen(name) < sizeof(pipeline->passes[0].name) && !(name[0] >= '0' && name[0] <= '9')
+                 && strcmp(name, UNIFORM_BACKBUFFER);
+        for (char * c = name; *c; ++c) {
+            valid &= (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || *c == '_';
+        }
+        if (!valid) {
+            snprintf(message, message_size, "Invalid pass name '%s'.", name);
+            return 0;
+        }
+        for (int i = 0; i < pipeline->pass_count; ++i) {
+            if (!strcmp(pipeline->passes[i].name, name)) {
+                snprintf(message, message_size, "Pass '%s' is declared twice.", name);
+                return 0;
+            }
+        }
+        if (pipeline->pass_count == PASS_LIMIT) {
+            snprintf(message, message_size, "Too many passes (the limit is %d).", PASS_LIMIT);
+            return 0;
+        }
+        Pass * pass = &pipeline->passes[pipeline->pass_count++];
+        strcpy(pass->name, name);
+        if (directory_length + strlen(pass_file) >= sizeof(pass->file_name)) {
+            snprintf(message, message_size, "The file name of pass '%s' is too long.", name);
+            return 0;
+        }
+        memcpy(pass->file_name, file_name, directory_length);
+        strcpy(pass->file_name + directory_length, pass_file);
+    }
+    return 1;
+}
+
+// Depth-first topological sort. Returns 0 if a pass depends on itself through
+// another pass, naming it in message.
+int visit_pass(Pipeline * pipeline, int index, char * state, int * count, char * message, int message_size) {
+    if (state[index] == 2) return 1;
+    if (state[index] == 1) {
+        snprintf(message, message_size, "Pass '%s' depends on itself through another pass.",
+            pipeline->passes[index].name);
+        return 0;
+    }
+    state[index] = 1;
+    Pass * pass = &pipeline->passes[index];
+    for (int i = 0; i < pipeline->pass_count - 1; ++i) {
+        if (i == index || pass->samplers[i] == -1) continue;
+        if (!visit_pass(pipeline, i, state, count, message, message_size)) return 0;
+    }
+    state[index] = 2;
+    pipeline->order[(*count)++] = index;
+    return 1;
+}
+
+// Build every program in a pipeline and work out the order to draw them in.
+// Targets are not created here (framebuffers belong to one context), but by
+// draw_pipeline when they are first needed. On failure this returns 0, with
+// a description of the problem in message.
+int build_pipeline(Pipeline * pipeline, char * file_name, char * message, int message_size) {
+    memset(pipeline, 0, sizeof(*pipeline));
+    char * source = read_file(file_name);
+    if (!source) {
+        snprintf(message, message_size, "Could not read file '%s'.", file_name);
+        return 0;
+    }
+    int parsed = parse_passes(pipeline, file_name, source, message, message_size);
+    free(source);
+    if (!parsed) return 0;
+
+    // The main shader goes last.
+    Pass * main_pass = &pipeline->passes[pipeline->pass_count++];
+    snprintf(main_pass->file_name, sizeof(main_pass->file_name), "%s", file_name);
+
+    int pass_count = pipeline->pass_count;
+    for (int i = 0; i < pass_count; ++i) {
+        Pass * pass = &pipeline->passes[i];
+        pass->program = build_program(pass->file_name, message, message_size);
+        if (!pass->program) {
+            pipeline->pass_count = i;
+            destroy_pipeline(pipeline);
+            return 0;
+        }
+        pass->uniforms = find_uniforms(pass->program);
+
+        // Each pass is always bound to the texture unit of the same number.
+        glUseProgram(pass->program);
+        for (int j = 0; j < pass_count - 1; ++j) {
+            pass->samplers[j] = glGetUniformLocation(pass->program, pipeline->passes[j].name);
+            if (pass->samplers[j] != -1) glUniform1i(pass->samplers[j], j);
+        }
+        for (int c = 0; c < CHANNEL_COUNT; ++c) {
+            char name[16];
+            snprintf(name, sizeof(name), UNIFORM_CHANNEL, c);
+            int channel = glGetUniformLocation(pass->program, name);
+            if (channel != -1) glUniform1i(channel, CHANNEL_UNIT + c);
+        }
+        if (i < pass_count - 1) {
+            pass->feedback = pass->samplers[i] != -1;
+        } else {
+            int backbuffer = glGetUniformLocation(pass->program, UNIFORM_BACKBUFFER);
+            if (backbuffer != -1) glUniform1i(backbuffer, BACKBUFFER_UNIT);
+            pass->feedback = backbuffer != -1;
+        }
+        pipeline->animated |= pass->feedback || uses_changing_uniforms(pass->program);
+    }
+    glUseProgram(0);
+
+    char state[PASS_LIMIT + 1] = { 0 };
+    int count = 0;
+    if (!visit_pass(pipeline, pass_count - 1, state, &count, message, message_size)) {
+        destroy_pipeline(pipeline);
+        return 0;
+    }
+    // Passes nothing reads are still drawn, as they may be read later.
+    for (int i = 0; i < pass_count - 1; ++i) {
+        if (!visit_pass(pipeline, i, state, &count, message, message_size)) {
+            destroy_pipeline(pipeline);
+            return 0;
+        }
+    }
+    // The main shader was placed before the unread passes; move it to the end.
+    for (int i = 0; i < count - 1; ++i) {
+        if (pipeline->order[i] == pass_count - 1) {
+            memmove(&pipeline->order[i], &pipeline->order[i + 1], (count - 1 - i) * sizeof(int));
+            pipeline->order[count - 1] = pass_count - 1;
+            break;
+        }
+    }
+    return 1;
+}
+
+// (Re)allocate a pass's textures to match the output. A pass that reads its
+// previous frame keeps it, scaled to the new size with a single blit. Both
+// cover the whole texture, even when drawing with a scissor.
+void resize_pass(Pass * pass, int width, int height) {
+    GLboolean scissor = glIsEnabled(GL_SCISSOR_TEST);
+    glDisable(GL_SCISSOR_TEST);
+    Target old[2] = { pass->targets[0], pass->targets[1] };
+    for (int t = 0; t < 1 + pass->feedback; ++t) {
+        pass->targets[t] = create_target(width, height, PASS_FORMAT);
+        glBindFramebuffer(GL_FRAMEBUFFER, pass->targets[t].framebuffer);
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
+    Target * previous = &old[pass->current];
+    if (pass->feedback && previous->framebuffer) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, previous->framebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, pass->targets[0].framebuffer);
+        glBlitFramebuffer(0, 0, previous->width, previous->height, 0, 0, width, height,
+            GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    }
+    pass->current = 0;
+    for (int t = 0; t < 2; ++t) destroy_target(&old[t]);
+    if (scissor) glEnable(GL_SCISSOR_TEST);
+}
+
+// Get ready to draw the k-th pass in the pipeline's order into an output of
+// the given size, and return the target it draws into. Passes are drawn into
+// their own textures, as is the main shader if it reads the backbuffer. They
+// are allocated when first drawn.
+Target * begin_pass(Pipeline * pipeline, int k, UniformValues * values, Target * output) {
+    int width = output->width, height = output->height;
+    int index = pipeline->order[k];
+    Pass * pass = &pipeline->passes[index];
+    int is_main = index == pipeline->pass_count - 1;
+
+    Target * target = output;
+    if (!is_main || pass->feedback) {
+        if (pass->targets[0].width != width || pass->targets[0].height != height) {
+            resize_pass(pass, width, height);
+        }
+        target = &pass->targets[pass->feedback ? 1 - pass->current : 0];
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, target->framebuffer);
+    glViewport(0, 0, width, height);
+    glUseProgram(pass->program);
+    set_uniforms(&pass->uniforms, values);
+    for (int j = 0; j < pipeline->pass_count - 1; ++j) {
+        if (pass->samplers[j] == -1) continue;
+        Pass * input = &pipeline->passes[j];
+        glActiveTexture(GL_TEXTURE0 + j);
+        glBindTexture(GL_TEXTURE_2D, input->targets[input->current].texture);
+    }
+    if (is_main && pass->feedback) {
+        glActiveTexture(GL_TEXTURE0 + BACKBUFFER_UNIT);
+        glBindTexture(GL_TEXTURE_2D, pass->targets[pass->current].texture);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    return target;
+}
+
+// Finish the k-th pass once all of it has been drawn into target.
+void end_pass(Pipeline * pipeline, int k, Target * target, Target * output) {
+    int index = pipeline->order[k];
+    Pass * pass = &pipeline->passes[index];
+    int is_main = index == pipeline->pass_count - 1;
+    if (pass->feedback) pass->current = 1 - pass->current;
+    if (is_main && pass->feedback) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, target->framebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, output->framebuffer);
+        glBlitFramebuffer(0, 0, output->width, output->height, 0, 0, output->width, output->height,
+            GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, output->framebuffer);
+    }
+}
+
+// Draw a pipeline into an output target, and leave the output bound. Passes
+// are drawn at the output's size, which may be only a tile of the resolution
+// that the shaders are given.
+void draw_pipeline(Pipeline * pipeline, UniformValues * values, Target * output) {
+    for (int k = 0; k < pipeline->pass_count; ++k) {
+        Target * target = begin_pass(pipeline, k, values, output);
+        if (pipeline->order[k] == pipeline->pass_count - 1) glClear(GL_COLOR_BUFFER_BIT);
+        draw_fullscreen_quad();
+        end_pass(pipeline, k, target, output);
+    }
+}
+
+// Progressive rendering spreads a frame that takes too long to draw at once
+// over many presents. Each present draws a few bands of rows with a scissor,
+// waits for the GPU to finish them, and stops once its time slice is spent,
+// so no single submission runs long enough to trip the driver's watchdog and
+// events are still handled between slices. Passes are drawn one after
+// another in the same way, each finishing before the next starts. The frame
+// builds up in a target of its own, which is shown as it is drawn. The cost
+// of each band is measured to learn how many pixels per millisecond each
+// pass draws, and the next band is sized to fit what is left of the slice.
+typedef struct {
+    // Milliseconds of drawing per present.
+    double slice;
+    Target target;
+    // The pass (position in the pipeline's order) and row to draw next.
+    int k, row;
+    // The values of the uniforms are kept for the whole of a frame.
+    UniformValues values;
+    // Pixels per millisecond for each pass, or 0 if not yet measured.
+    double rates[PASS_LIMIT + 1];
+    // For reporting: frames completed, and the presents and start of this one.
+    int frames, presents;
+    u64 frame_start;
+} Progressive;
+
+void progressive_init(Progressive * progressive, double slice) {
+    memset(progressive, 0, sizeof(*progressive));
+    progressive->slice = slice;
+}
+
+// Returns 1 if the next call to progressive_draw (with an output of width by
+// height) starts a new frame, which should then be given new values.
+int progressive_idle(Progressive * progressive, int width, int height) {
+    return (progressive->k == 0 && progressive->row == 0)
+        || progressive->target.width != width || progressive->target.height != height;
+}
+
+// Abandon the frame being drawn, such as when the pipeline has changed.
+void progressive_restart(Progressive * progressive) {
+    progressive->k = progressive->row = 0;
+}
+
+// Draw the next slice of the frame, then copy the frame so far to the output
+// and leave it bound. Returns 1 if that completed the frame.
+int progressive_draw(Progressive * progressive, Pipeline * pipeline, Target * output) {
+    int width = output->width, height = output->height;
+    if (progressive_idle(progressive, width, height)) {
+        if (progressive->target.width != width || progressive->target.height != height) {
+            destroy_target(&progressive->target);
+            progressive->target = create_target(width, height, GL_RGBA8);
+            progressive_restart(progressive);
+        }
+        progressive->frame_start = SDL_GetPerformanceCounter();
+        progressive->presents = 0;
+    }
+    ++progressive->presents;
+
+    int complete = 0;
+    u64 slice_start = SDL_GetPerformanceCounter();
+    glEnable(GL_SCISSOR_TEST);
+    for (int bands = 0; ; ++bands) {
+        double remaining = progressive->slice - seconds_between(slice_start, SDL_GetPerformanceCounter()) * 1000.0;
+        // Always draw at least one band, so that the frame moves on.
+        if (remaining <= 0.0 && bands) break;
+        if (remaining < progressive->slice * 0.25) remaining = progressive->slice * 0.25;
+
+        int index = pipeline->order[progressive->k];
+        double rate = progressive->rates[index];
+        int rows = rate > 0.0 ? (int)(rate * remaining / width) : 1;
+        if (rows < 1) rows = 1;
+        if (rows > height - progressive->row) rows = height - progressive->row;
+
+        Target * target = begin_pass(pipeline, progressive->k, &progressive->values, &progressive->target);
+        glScissor(0, progressive->row, width, rows);
+        u64 band_start = SDL_GetPerformanceCounter();
+        draw_fullscreen_quad();
+        GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+        glDeleteSync(fence);
+        double milliseconds = seconds_between(band_start, SDL_GetPerformanceCounter()) * 1000.0;
+        if (milliseconds > 0.0) {
+            double measured = (double)width * rows / milliseconds;
+            progressive->rates[index] = rate > 0.0 ? rate * 0.5 + measured * 0.5 : measured;
+        }
+
+        progressive->row += rows;
+        if (progressive->row < height) continue;
+        glDisable(GL_SCISSOR_TEST);
+        end_pass(pipeline, progressive->k, target, &progressive->target);
+        glEnable(GL_SCISSOR_TEST);
+        progressive->row = 0;
+        if (++progressive->k == pipeline->pass_count) {
+            progressive->k = 0;
+            ++progressive->frames;
+            complete = 1;
+            break;
+        }
+    }
+    glDisable(GL_SCISSOR_TEST);
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, progressive->target.framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, output->framebuffer);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, output->framebuffer);
+    return complete;
+}
+
+// Accumulation averages the frames of a shader that draws a different random
+// sample each frame (seeded by the random uniform), so that a noisy image
+// converges on a clean one. Each frame is drawn into a 32-bit float target
+// and blended into another with a weight of 1 / n for the n-th sample, which
+// keeps that the mean of all the samples so far. Samples are all drawn at
+// the same moment: only random and frame change between them. Once enough
+// samples are taken nothing more is drawn, and the mean is shown until the
+// resolution, mouse or button changes, which starts over.
+char accumulate_source[] =
+    "#version 330\n"
+    "uniform sampler2D frame;\n"
+    "out vec4 mean;\n"
+    "void main() {\n"
+    "    mean = texelFetch(frame, ivec2(gl_FragCoord.xy), 0);\n"
+    "}\n";
+
+typedef struct {
+    // The number of samples to stop at, and the number taken so far.
+    int limit, samples;
+    GLuint program;
+    Target frame, mean;
+    // The values the samples are drawn with.
+    UniformValues values;
+    // When the first sample was drawn, for reporting.
+    u64 start;
+} Accumulator;
+
+void accumulate_init(Accumulator * accumulator, int limit) {
+    memset(accumulator, 0, sizeof(*accumulator));
+    accumulator->limit = limit;
+    accumulator->program = create_internal_program(accumulate_source);
+}
+
+// Throw away the samples taken so far, such as when the pipeline has changed.
+void accumulate_reset(Accumulator * accumulator) {
+    accumulator->samples = 0;
+}
+
+int accumulate_done(Accumulator * accumulator) {
+    return accumulator->samples >= accumulator->limit;
+}
+
+// Get the values to draw the next sample with, given this frame's values.
+// Starts over if they no longer show the same image.
+UniformValues * accumulate_values(Accumulator * accumulator, UniformValues * values) {
+    UniformValues * held = &accumulator->values;
+    if (held->width != values->width || held->height != values->height
+     || held->mouse_x != values->mouse_x || held->mouse_y != values->mouse_y || held->button != values->button) {
+        accumulate_reset(accumulator);
+    }
+    if (!accumulator->samples) {
+        *held = *values;
+    } else {
+        held->random = values->random;
+        held->frame = values->frame;
+        held->delta = 0.0f;
+    }
+    return held;
+}
+
+// Draw the next sample (unless there are enough) and add it to the mean, then
+// copy the mean to the output and leave it bound. Returns 1 if that was the
+// last sample.
+int accumulate_draw(Accumulator * accumulator, Pipeline * pipeline, UniformValues * values, Target * output) {
+    int width = output->width, height = output->height;
+    if (accumulator->mean.width != width || accumulator->mean.height != height) {
+        destroy_target(&accumulator->frame);
+        destroy_target(&accumulator->mean);
+        accumulator->frame = create_target(width, height, GL_RGBA32F);
+        accumulator->mean = create_target(width, height, GL_RGBA32F);
+        accumulate_reset(accumulator);
+    }
+
+    int finished = 0;
+    if (!accumulate_done(accumulator)) {
+        if (!accumulator->samples) accumulator->start = SDL_GetPerformanceCounter();
+        draw_pipeline(pipeline, values, &accumulator->frame);
+
+        // mean = mean * (1 - 1 / n) + sample / n. The first sample replaces
+        // whatever was there.
+        glBindFramebuffer(GL_FRAMEBUFFER, accumulator->mean.framebuffer);
+        glViewport(0, 0, width, height);
+        glUseProgram(accumulator->program);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, accumulator->frame.texture);
+        glEnable(GL_BLEND);
+        glBlendColor(0.0f, 0.0f, 0.0f, 1.0f / (accumulator->samples + 1));
+        glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA);
+        draw_fullscreen_quad();
+        glDisable(GL_BLEND);
+        finished = ++accumulator->samples == accumulator->limit;
+    }
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, accumulator->mean.framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, output->framebuffer);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, output->framebuffer);
+    return finished;
+}
+
+// Scaling renders the pipeline into an offscreen target smaller than the
+// output, then stretches it over the output. Every shader sees the smaller
+// size in the resolution uniform and gl_FragCoord (and the mouse is scaled to
+// match), so their maths is unchanged. The scale is either fixed, or chosen
+// by a controller that aims for a budget of time per frame: every few frames
+// it picks the scale whose pixel count should just fit the budget, assuming
+// the cost grows with the number of pixels. Changes smaller than
+// a step are ignored, so the targets are not reallocated every few frames.
+#define SCALE_MIN 0.25f
+#define SCALE_STEP 0.05f
+#define SCALE_ADJUST_FRAMES 8
+
+char sharpen_source[] =
+    "#version 330\n"
+    "uniform sampler2D source;\n"
+    "uniform vec2 size;\n"
+    "out vec4 frag;\n"
+    // Bilinear filtering, then an unsharp mask over the neighbouring source
+    // texels, clamped to their range so edges do not ring.
+    "void main() {\n"
+    "    vec2 uv = gl_FragCoord.xy / size;\n"
+    "    vec2 texel = 1.0 / vec2(textureSize(source, 0));\n"
+    "    vec3 c = texture(source, uv).rgb;\n"
+    "    vec3 n = texture(source, uv + vec2(0.0, texel.y)).rgb;\n"
+    "    vec3 s = texture(source, uv - vec2(0.0, texel.y)).rgb;\n"
+    "    vec3 e = texture(source, uv + vec2(texel.x, 0.0)).rgb;\n"
+    "    vec3 w = texture(source, uv - vec2(texel.x, 0.0)).rgb;\n"
+    "    vec3 low = min(c, min(min(n, s), min(e, w)));\n"
+    "    vec3 high = max(c, max(max(n, s), max(e, w)));\n"
+    "    frag = vec4(clamp(c + (c - (n + s + e + w) * 0.25) * 0.8, low, high), 1.0);\n"
+    "}\n";
+
+typedef struct {
+    float scale, max_scale;
+    // Milliseconds per frame to aim for, or 0 to keep the scale fixed.
+    double budget;
+    double measured;
+    int measured_count;
+    // The average milliseconds per frame that the last adjustment used.
+    double average;
+    int sharpen;
+    GLuint sharpen_program;
+    Target target;
+} Scaler;
+
+void scale_init(Scaler * scaler, float scale, double budget, int sharpen) {
+    memset(scaler, 0, sizeof(*scaler));
+    scaler->scale = scaler->max_scale = scale;
+    scaler->budget = budget;
+    scaler->sharpen = sharpen;
+    if (sharpen) scaler->sharpen_program = create_internal_program(sharpen_source);
+}
+
+// Get the target to draw a frame into, sized for an output of width by height.
+Target * scale_target(Scaler * scaler, int width, int height) {
+    int scaled_width = (int)(width * scaler->scale + 0.5f);
+    int scaled_height = (int)(height * scaler->scale + 0.5f);
+    if (scaled_width < 1) scaled_width = 1;
+    if (scaled_height < 1) scaled_height = 1;
+    if (scaler->target.width != scaled_width || scaler->target.height != scaled_height) {
+        destroy_target(&scaler->target);
+        scaler->target = create_target(scaled_width, scaled_height, GL_RGBA8);
+    }
+    return &scaler->target;
+}
+
+// Stretch the drawn frame over the output, and leave the output bound.
+void scale_present(Scaler * scaler, Target * output) {
+    Target * source = &scaler->target;
+    if (scaler->sharpen) {
+        glBindFramebuffer(GL_FRAMEBUFFER, output->framebuffer);
+        glViewport(0, 0, output->width, output->height);
+        glUseProgram(scaler->sharpen_program);
+        glUniform2f(glGetUniformLocation(scaler->sharpen_program, "size"), output->width, output->height);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, source->texture);
+        draw_fullscreen_quad();
+    } else {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, source->framebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, output->framebuffer);
+        glBlitFramebuffer(0, 0, source->width, source->height, 0, 0, output->width, output->height,
+            GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, output->framebuffer);
+}
+
+// Feed the controller the time one frame took. Returns 1 if the scale changed.
+int scale_adjust(Scaler * scaler, double milliseconds) {
+    if (!scaler->budget) return 0;
+    scaler->measured += milliseconds;
+    if (++scaler->measured_count < SCALE_ADJUST_FRAMES) return 0;
+    double average = scaler->measured / scaler->measured_count;
+    scaler->average = average;
+    scaler->measured = 0.0;
+    scaler->measured_count = 0;
+    if (average <= 0.0) return 0;
+
+    float scale = scaler->scale * SDL_sqrt(scaler->budget / average);
+    int to_max = scale >= scaler->max_scale;
+    if (scale > scaler->max_scale) scale = scaler->max_scale;
+    if (scale < SCALE_MIN) scale = SCALE_MIN;
+    // Move halfway there, to settle without oscillating, rounding down to a
+    // whole step so that the budget is more likely met than missed. Heading
+    // for the largest scale (which need not be a whole step), round up
+    // instead, so that it is reached and kept.
+    scale = scaler->scale + (scale - scaler->scale) * 0.5f;
+    scale = (int)(scale / SCALE_STEP + (to_max ? 0.999f : 0.001f)) * SCALE_STEP;
+    if (scale > scaler->max_scale) scale = scaler->max_scale;
+    if (scale < SCALE_MIN) scale = SCALE_MIN;
+    if (scale == scaler->scale) return 0;
+    scaler->scale = scale;
+    return 1;
+}
+
+// Anti-aliasing smooths the edges of shaders that draw one sample per pixel.
+//
+// Supersampling draws the whole pipeline at N times the output's width and
+// height (the shaders see the larger resolution, with the mouse scaled to
+// match) and averages each N by N block of pixels. It is the most accurate,
+// and costs N * N times as much.
+//
+// Edge anti-aliasing draws at the output's size and blurs along the edges it
+// finds in the result, in the manner of FXAA. It costs little more than one
+// extra pass, but cannot recover detail thinner than a pixel.
+//
+// Adaptive anti-aliasing draws at the output's size too, then marks in a
+// stencil buffer the pixels whose neighbourhood has high contrast. The main
+// shader is drawn again over only those pixels, at four rotated grid
+// positions within each pixel (moving gl_FragCoord), and the samples are
+// averaged with blending. Most pixels of most images are flat, so this gets
+// close to 4x supersampling at a fraction of its cost. Offscreen passes are
+// not drawn again, and a main shader that reads the backbuffer is not
+// reshaded at all, since its input would be the frame it is drawing.
+typedef enum { AA_NONE, AA_SSAA, AA_EDGE, AA_ADAPTIVE } AntialiasMode;
+
+#define AA_SAMPLE_COUNT 4
+
+float aa_sample_offsets[AA_SAMPLE_COUNT][2] = {
+    { 0.125f, 0.375f }, { 0.375f, -0.125f }, { -0.125f, -0.375f }, { -0.375f, 0.125f }
+};
+
+char downsample_source[] =
+    "#version 330\n"
+    "uniform sampler2D source;\n"
+    "uniform int factor;\n"
+    "out vec4 frag;\n"
+    "void main() {\n"
+    "    ivec2 base = ivec2(gl_FragCoord.xy) * factor;\n"
+    "    vec4 sum = vec4(0.0);\n"
+    "    for (int y = 0; y < factor; ++y) {\n"
+    "        for (int x = 0; x < factor; ++x) sum += texelFetch(source, base + ivec2(x, y), 0);\n"
+    "    }\n"
+    "    frag = sum / float(factor * factor);\n"
+    "}\n";
+
+char edge_source[] =
+    "#version 330\n"
+    "uniform sampler2D source;\n"
+    "out vec4 frag;\n"
+    "float luma(vec2 uv) { return dot(clamp(texture(source, uv).rgb, 0.0, 1.0), vec3(0.299, 0.587, 0.114)); }\n"
+    "void main() {\n"
+    "    vec2 texel = 1.0 / vec2(textureSize(source, 0));\n"
+    "    vec2 uv = gl_FragCoord.xy * texel;\n"
+    "    vec3 centre = texture(source, uv).rgb;\n"
+    "    float m = luma(uv);\n"
+    "    float nw = luma(uv + vec2(-0.5, 0.5) * texel), ne = luma(uv + vec2(0.5, 0.5) * texel);\n"
+    "    float sw = luma(uv + vec2(-0.5, -0.5) * texel), se = luma(uv + vec2(0.5, -0.5) * texel);\n"
+    "    float low = min(m, min(min(nw, ne), min(sw, se)));\n"
+    "    float high = max(m, max(max(nw, ne), max(sw, se)));\n"
+    "    if (high - low < max(0.0312, high * 0.125)) {\n"
+    "        frag = vec4(centre, 1.0);\n"
+    "        return;\n"
+    "    }\n"
+    // Blur across the gradient, which runs along the edge, by up to 8 texels.
+    "    vec2 direction = vec2(-((nw + ne) - (sw + se)), (nw + sw) - (ne + se));\n"
+    "    float reduce = max((nw + ne + sw + se) * 0.03125, 1.0 / 128.0);\n"
+    "    direction *= 1.0 / (min(abs(direction.x), abs(direction.y)) + reduce);\n"
+    "    direction = clamp(direction, -8.0, 8.0) * texel;\n"
+    "    vec3 near = 0.5 * (texture(source, uv - direction / 6.0).rgb + texture(source, uv + direction / 6.0).rgb);\n"
+    "    vec3 far = near * 0.5 + 0.25 * (texture(source, uv - direction * 0.5).rgb\n"
+    "                                  + texture(source, uv + direction * 0.5).rgb);\n"
+    // The wider blur is only kept if it stays within the local range.
+    "    float far_luma = dot(clamp(far, 0.0, 1.0), vec3(0.299, 0.587, 0.114));\n"
+    "    frag = vec4(far_luma < low || far_luma > high ? near : far, 1.0);\n"
+    "}\n";
+
+char contrast_source[] =
+    "#version 330\n"
+    "uniform sampler2D source;\n"
+    "uniform float threshold;\n"
+    "out vec4 frag;\n"
+    "void main() {\n"
+    "    ivec2 p = ivec2(gl_FragCoord.xy);\n"
+    "    ivec2 last = textureSize(source, 0) - 1;\n"
+    "    float low = 1.0, high = 0.0;\n"
+    "    for (int y = -1; y <= 1; ++y) {\n"
+    "        for (int x = -1; x <= 1; ++x) {\n"
+    "            vec3 c = clamp(texelFetch(source, clamp(p + ivec2(x, y), ivec2(0), last), 0).rgb, 0.0, 1.0);\n"
+    "            float l = dot(c, vec3(0.299, 0.587, 0.114));\n"
+    "            low = min(low, l);\n"
+    "            high = max(high, l);\n"
+    "        }\n"
+    "    }\n"
+    // Flat pixels leave the stencil alone.
+    "    if (high - low < threshold) discard;\n"
+    "    frag = vec4(0.0);\n"
+    "}\n";
+
+typedef struct {
+    AntialiasMode mode;
+    // Supersampling's factor, and the factor used for the current size,
+    // which may be lower if the larger target would be too big.
+    int factor, used_factor;
+    // The difference in luma that marks a pixel for reshading.
+    float threshold;
+    GLuint program;
+    // The frame as drawn, and (when adaptive) the frame being reshaded, with
+    // its stencil buffer.
+    Target frame, samples;
+    GLuint stencil;
+    UniformValues values;
+    // Measures how many pixels the adaptive mode reshades.
+    GLuint query;
+    int query_pending;
+    double reshaded_sum;
+    int reshaded_count;
+} Antialiaser;
+
+void aa_init(Antialiaser * antialiaser, AntialiasMode mode, int factor, float threshold) {
+    memset(antialiaser, 0, sizeof(*antialiaser));
+    antialiaser->mode = mode;
+    antialiaser->factor = factor;
+    antialiaser->threshold = threshold;
+    if (mode == AA_SSAA) antialiaser->program = create_internal_program(downsample_source);
+    if (mode == AA_EDGE) antialiaser->program = create_internal_program(edge_source);
+    if (mode == AA_ADAPTIVE) {
+        antialiaser->program = create_internal_program(contrast_source);
+        glGenQueries(1, &antialiaser->query);
+    }
+}
+
+// Get the values to draw the pipeline with for an output of width by height,
+// and make sure the targets fit it.
+UniformValues * aa_values(Antialiaser * antialiaser, UniformValues * values, int width, int height) {
+    int factor = 1;
+    if (antialiaser->mode == AA_SSAA) {
+        GLint max_size;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+        int largest = width > height ? width : height;
+        factor = antialiaser->factor;
+        while (factor > 1 && largest * factor > max_size) --factor;
+    }
+    antialiaser->used_factor = factor;
+
+    if (antialiaser->frame.width != width * factor || antialiaser->frame.height != height * factor) {
+        destroy_target(&antialiaser->frame);
+        antialiaser->frame = create_target(width * factor, height * factor,
+            antialiaser->mode == AA_ADAPTIVE ? PASS_FORMAT : GL_RGBA8);
+        if (antialiaser->mode == AA_ADAPTIVE) {
+            destroy_target(&antialiaser->samples);
+            if (antialiaser->stencil) glDeleteRenderbuffers(1, &antialiaser->stencil);
+            antialiaser->samples = create_target(width, height, PASS_FORMAT);
+            glGenRenderbuffers(1, &antialiaser->stencil);
+            glBindRenderbuffer(GL_RENDERBUFFER, antialiaser->stencil);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+            glBindFramebuffer(GL_FRAMEBUFFER, antialiaser->samples.framebuffer);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, antialiaser->stencil);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                panic_exit("Could not create a %dx%d framebuffer with a stencil buffer.", width, height);
+            }
+        }
+    }
+
+    antialiaser->values = *values;
+    antialiaser->values.width *= factor;
+    antialiaser->values.height *= factor;
+    antialiaser->values.mouse_x *= factor;
+    antialiaser->values.mouse_y *= factor;
+    return &antialiaser->values;
+}
+
+// Draw the pipeline with the values from aa_values, anti-aliased, into the
+// output, and leave the output bound.
+void aa_draw(Antialiaser * antialiaser, Pipeline * pipeline, UniformValues * values, Target * output) {
+    Target * frame = &antialiaser->frame;
+    draw_pipeline(pipeline, values, frame);
+
+    if (antialiaser->mode != AA_ADAPTIVE) {
+        glBindFramebuffer(GL_FRAMEBUFFER, output->framebuffer);
+        glViewport(0, 0, output->width, output->height);
+        glUseProgram(antialiaser->program);
+        if (antialiaser->mode == AA_SSAA) {
+            glUniform1i(glGetUniformLocation(antialiaser->program, "factor"), antialiaser->used_factor);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, frame->texture);
+        draw_fullscreen_quad();
+        return;
+    }
+
+    // Collect the last measurement, if it is ready.
+    if (antialiaser->query_pending) {
+        GLuint available = 0, pixels = 0;
+        glGetQueryObjectuiv(antialiaser->query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            glGetQueryObjectuiv(antialiaser->query, GL_QUERY_RESULT, &pixels);
+            antialiaser->reshaded_sum += (double)pixels / ((double)frame->width * frame->height);
+            ++antialiaser->reshaded_count;
+            antialiaser->query_pending = 0;
+        }
+    }
+
+    // Copy the frame, then mark the pixels that need more samples.
+    Target * samples = &antialiaser->samples;
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, frame->framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, samples->framebuffer);
+    glBlitFramebuffer(0, 0, frame->width, frame->height, 0, 0, samples->width, samples->height,
+        GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, samples->framebuffer);
+    glViewport(0, 0, samples->width, samples->height);
+    glClear(GL_STENCIL_BUFFER_BIT);
+    glEnable(GL_STENCIL_TEST);
+    glStencilFunc(GL_ALWAYS, 1, 0xff);
+    glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glUseProgram(antialiaser->program);
+    glUniform1f(glGetUniformLocation(antialiaser->program, "threshold"), antialiaser->threshold);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, frame->texture);
+    draw_fullscreen_quad();
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+    // Draw the main shader again over the marked pixels, keeping the mean of
+    // the samples (the first being the one already drawn at the centre).
+    int main_index = pipeline->pass_count - 1;
+    if (!pipeline->passes[main_index].feedback) {
+        glStencilFunc(GL_EQUAL, 1, 0xff);
+        glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA);
+        for (int i = 0; i < AA_SAMPLE_COUNT; ++i) {
+            UniformValues sample_values = *values;
+            sample_values.offset_x += aa_sample_offsets[i][0];
+            sample_values.offset_y += aa_sample_offsets[i][1];
+            begin_pass(pipeline, pipeline->pass_count - 1, &sample_values, samples);
+            glBlendColor(0.0f, 0.0f, 0.0f, 1.0f / (i + 2));
+            int measure = i == 0 && !antialiaser->query_pending;
+            if (measure) glBeginQuery(GL_SAMPLES_PASSED, antialiaser->query);
+            draw_fullscreen_quad();
+            if (measure) {
+                glEndQuery(GL_SAMPLES_PASSED);
+                antialiaser->query_pending = 1;
+            }
+        }
+        glDisable(GL_BLEND);
+    }
+    glDisable(GL_STENCIL_TEST);
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, samples->framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, output->framebuffer);
+    glBlitFramebuffer(0, 0, samples->width, samples->height, 0, 0, output->width, output->height,
+        GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, output->framebuffer);
+}
+
+void aa_report(Antialiaser * antialiaser) {
+    if (antialiaser->mode != AA_ADAPTIVE || !antialiaser->reshaded_count) return;
+    printf("Anti-aliasing: reshaded %.1f%% of pixels on average.\n",
+        antialiaser->reshaded_sum / antialiaser->reshaded_count * 100.0);
+}
+
+// A poster is a still image larger than anything the GPU could draw at once.
+// It is drawn in tiles, each with gl_FragCoord moved so that the shaders see
+// one image of the poster's full resolution. Each tile is read back into a
+// pixel buffer while the next one draws, and copied into a band of rows one
+// tile high; whole bands are written to the file in the order it stores rows,
+// so the complete image is never held in memory. Offscreen passes and the
+// backbuffer would need textures of the whole poster, so shaders that use
+// them cannot be drawn as posters.
+#define POSTER_TILE_SIZE 1024
+
+typedef struct {
+    GLuint buffer;
+    GLsync fence;
+    int x, y, width, height;
+} PosterTile;
+
+// Copy a finished tile into its place in the band.
+void poster_copy_tile(PosterTile * tile, unsigned char * band, int band_y, int width, int pixel_size) {
+    while (glClientWaitSync(tile->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+    glDeleteSync(tile->fence);
+    tile->fence = 0;
+    size_t row_size = (size_t)tile->width * pixel_size;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, tile->buffer);
+    unsigned char * pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, row_size * tile->height, GL_MAP_READ_BIT);
+    if (!pixels) panic_exit("Could not read back a poster tile.");
+    for (int row = 0; row < tile->height; ++row) {
+        unsigned char * destination = band + ((size_t)(tile->y - band_y + row) * width + tile->x) * pixel_size;
+        memcpy(destination, pixels + row * row_size, row_size);
+    }
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+void render_poster(Pipeline * pipeline, UniformBlock * block, UniformValues * values, char * file_name,
+    int width, int height) {
+    if (pipeline->pass_count > 1 || pipeline->passes[0].feedback) {
+        panic_exit("Posters cannot be drawn from shaders with passes or a backbuffer.");
+    }
+    ImageFormat format = image_format_for(file_name);
+    if (format == IMAGE_TGA && (width > 0xffff || height > 0xffff)) {
+        panic_exit("A TGA file can be at most 65535 pixels wide and high.");
+    }
+    int pixel_size = image_pixel_size(format);
+
+    // Tiles must fit in a viewport and a texture.
+    GLint viewport_limit[2], texture_limit;
+    glGetIntegerv(GL_MAX_VIEWPORT_DIMS, viewport_limit);
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &texture_limit);
+    int tile_size = POSTER_TILE_SIZE;
+    if (tile_size > viewport_limit[0]) tile_size = viewport_limit[0];
+    if (tile_size > viewport_limit[1]) tile_size = viewport_limit[1];
+    if (tile_size > texture_limit) tile_size = texture_limit;
+    int tile_width = width < tile_size ? width : tile_size;
+    int tile_height = height < tile_size ? height : tile_size;
+
+    FILE * file = fopen(file_name, "wb");
+    if (!file) panic_exit("Could not open file '%s' for writing.", file_name);
+    write_image_header(file, format, width, height);
+    unsigned char * band = malloc((size_t)width * tile_height * pixel_size);
+    if (!band) panic_exit("Could not allocate space for a %dx%d band of the poster.", width, tile_height);
+
+    PosterTile tiles[2] = { 0 };
+    for (int i = 0; i < 2; ++i) {
+        glGenBuffers(1, &tiles[i].buffer);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, tiles[i].buffer);
+        glBufferData(GL_PIXEL_PACK_BUFFER, (size_t)tile_width * tile_height * pixel_size, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    Target target = create_target(tile_width, tile_height, GL_RGBA8);
+
+    values->width = width;
+    values->height = height;
+    // The block does not hold the offset, so it is the same for every tile.
+    uniform_block_update(block, values);
+    u64 start = SDL_GetPerformanceCounter();
+    int band_count = (height + tile_height - 1) / tile_height;
+    int columns = (width + tile_width - 1) / tile_width;
+    int next = 0;
+    for (int b = 0; b < band_count; ++b) {
+        // PPM files start with the top row, TGA files with the bottom one.
+        int band_index = format == IMAGE_TGA ? b : band_count - 1 - b;
+        int band_y = band_index * tile_height;
+        int band_height = height - band_y < tile_height ? height - band_y : tile_height;
+        for (int column = 0; column < columns; ++column) {
+            PosterTile * tile = &tiles[next];
+            next = 1 - next;
+            tile->x = column * tile_width;
+            tile->y = band_y;
+            tile->width = width - tile->x < tile_width ? width - tile->x : tile_width;
+            tile->height = band_height;
+
+            values->offset_x = tile->x;
+            values->offset_y = tile->y;
+            target.width = tile->width;
+            target.height = tile->height;
+            draw_pipeline(pipeline, values, &target);
+
+            glPixelStorei(GL_PACK_ALIGNMENT, 1);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, target.framebuffer);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, tile->buffer);
+            glReadPixels(0, 0, tile->width, tile->height, image_gl_format(format), GL_UNSIGNED_BYTE, 0);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            tile->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+            // Collect the previous tile while this one draws.
+            PosterTile * previous = &tiles[next];
+            if (previous->fence) poster_copy_tile(previous, band, band_y, width, pixel_size);
+        }
+        // The band's last tile is still in flight.
+        PosterTile * last = &tiles[1 - next];
+        poster_copy_tile(last, band, band_y, width, pixel_size);
+
+        size_t row_size = (size_t)width * pixel_size;
+        if (format == IMAGE_TGA) {
+            fwrite(band, row_size, band_height, file);
+        } else {
+            for (int y = band_height - 1; y >= 0; --y) fwrite(band + y * row_size, 1, row_size, file);
+        }
+        if (ferror(file)) panic_exit("Could not write to file '%s'.", file_name);
+    }
+    if (fclose(file)) panic_exit("Could not write to file '%s'.", file_name);
+
+    printf("Rendered a %dx%d poster in %d tiles of up to %dx%d to '%s' in %.3f s.\n",
+        width, height, band_count * columns, tile_width, tile_height, file_name,
+        seconds_between(start, SDL_GetPerformanceCounter()));
+    free(band);
+    destroy_target(&target);
+    for (int i = 0; i < 2; ++i) glDeleteBuffers(1, &tiles[i].buffer);
+}
+
+// An 8-bit RGBA image, stored bottom row first like an OpenGL texture.
+typedef struct {
+    unsigned char * pixels;
+    int width, height;
+} Image;
+
+// A decoder for zlib streams (RFC 1950 and 1951), as used by PNG. It inflates
+// into a buffer whose size is known up front, which PNG always allows.
+typedef struct {
+    const unsigned char * in;
+    size_t in_size, in_position;
+    unsigned bit_buffer;
+    int bit_count;
+    unsigned char * out;
+    size_t out_size, out_position;
+    int error;
+} Inflater;
+
+typedef struct {
+    short counts[16];
+    short symbols[288];
+} Huffman;
+
+int inflate_bits(Inflater * inflater, int count) {
+    unsigned value = inflater->bit_buffer;
+    while (inflater->bit_count < count) {
+        if (inflater->in_position == inflater->in_size) {
+            inflater->error = 1;
+            return 0;
+        }
+        value |= (unsigned)inflater->in[inflater->in_position++] << inflater->bit_count;
+        inflater->bit_count += 8;
+    }
+    inflater->bit_buffer = value >> count;
+    inflater->bit_count -= count;
+    return value & ((1u << count) - 1);
+}
+
+// Build canonical Huffman tables from code lengths. Returns 0 if the lengths
+// describe more codes than can exist.
+int build_huffman(Huffman * huffman, const short * lengths, int count) {
+    memset(huffman->counts, 0, sizeof(huffman->counts));
+    for (int i = 0; i < count; ++i) huffman->counts[lengths[i]]++;
+    int left = 1;
+    for (int length = 1; length < 16; ++length) {
+        left = (left << 1) - huffman->counts[length];
+        if (left < 0) return 0;
+    }
+    short offsets[16];
+    offsets[1] = 0;
+    for (int length = 1; length < 15; ++length) offsets[length + 1] = offsets[length] + huffman->counts[length];
+    for (int i = 0; i < count; ++i) {
+        if (lengths[i]) huffman->symbols[offsets[lengths[i]]++] = i;
+    }
+    return 1;
+}
+
+int decode_symbol(Inflater * inflater, Huffman * huffman) {
+    int code = 0, first = 0, index = 0;
+    for (int length = 1; length < 16; ++length) {
+        code |= inflate_bits(inflater, 1);
+        int count = huffman->counts[length];
+        if (code - count < first) return huffman->symbols[index + (code - first)];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    inflater->error = 1;
+    return 0;
+}
+
+int inflate_codes(Inflater * inflater, Huffman * lengths, Huffman * distances) {
+    static const short length_base[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const short length_extra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const short distance_base[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const short distance_extra[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+    while (!inflater->error) {
+        int symbol = decode_symbol(inflater, lengths);
+        if (symbol < 256) {
+            if (inflater->out_position == inflater->out_size) return 0;
+            inflater->out[inflater->out_position++] = symbol;
+        } else if (symbol == 256) {
+            return 1;
+        } else {
+            symbol -= 257;
+            if (symbol >= 29) return 0;
+            size_t length = length_base[symbol] + inflate_bits(inflater, length_extra[symbol]);
+            symbol = decode_symbol(inflater, distances);
+            if (symbol >= 30) return 0;
+            size_t distance = distance_base[symbol] + inflate_bits(inflater, distance_extra[symbol]);
+            if (distance > inflater->out_position || length > inflater->out_size - inflater->out_position) {
+                return 0;
+            }
+            for (size_t i = 0; i < length; ++i, ++inflater->out_position) {
+                inflater->out[inflater->out_position] = inflater->out[inflater->out_position - distance];
+            }
+        }
+    }
+    return 0;
+}
+
+int inflate_zlib(const unsigned char * in, size_t in_size, unsigned char * out, size_t out_size) {
+    if (in_size < 2 || (in[0] & 0x0f) != 8 || ((in[0] << 8) | in[1]) % 31 || (in[1] & 0x20)) return 0;
+    Inflater inflater = { in, in_size, 2, 0, 0, out, out_size, 0, 0 };
+    int last;
+    do {
+        last = inflate_bits(&inflater, 1);
+        int type = inflate_bits(&inflater, 2);
+        if (type == 0) {
+            // A stored block starts on a byte boundary.
+            inflater.bit_buffer = 0;
+            inflater.bit_count = 0;
+            if (inflater.in_position + 4 > in_size) return 0;
+            const unsigned char * header = in + inflater.in_position;
+            size_t length = header[0] | (header[1] << 8);
+            if ((length ^ 0xffff) != (size_t)(header[2] | (header[3] << 8))) return 0;
+            inflater.in_position += 4;
+            if (length > in_size - inflater.in_position || length > out_size - inflater.out_position) return 0;
+            memcpy(out + inflater.out_position, in + inflater.in_position, length);
+            inflater.in_position += length;
+            inflater.out_position += length;
+        } else if (type == 1 || type == 2) {
+            short lengths[320];
+            int literal_count = 288, distance_count = 30;
+            if (type == 1) {
+                // The fixed codes.
+                for (int i = 0; i < 144; ++i) lengths[i] = 8;
+                for (int i = 144; i < 256; ++i) lengths[i] = 9;
+                for (int i = 256; i < 280; ++i) lengths[i] = 7;
+                for (int i = 280; i < 288; ++i) lengths[i] = 8;
+                for (int i = 0; i < 30; ++i) lengths[288 + i] = 5;
+            } else {
+                // The code lengths are themselves Huffman coded.
+                static const short order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+                literal_count = inflate_bits(&inflater, 5) + 257;
+                distance_count = inflate_bits(&inflater, 5) + 1;
+                int code_count = inflate_bits(&inflater, 4) + 4;
+                if (literal_count > 286 || distance_count > 30) return 0;
+                short code_lengths[19] = { 0 };
+                for (int i = 0; i < code_count; ++i) code_lengths[order[i]] = inflate_bits(&inflater, 3);
+                Huffman codes;
+                if (!build_huffman(&codes, code_lengths, 19)) return 0;
+                for (int i = 0; i < literal_count + distance_count && !inflater.error;) {
+                    int symbol = decode_symbol(&inflater, &codes);
+                    if (symbol < 16) {
+                        lengths[i++] = symbol;
+                        continue;
+                    }
+                    int repeat = 0, value = 0;
+                    if (symbol == 16) {
+                        if (i == 0) return 0;
+                        value = lengths[i - 1];
+                        repeat = 3 + inflate_bits(&inflater, 2);
+                    } else if (symbol == 17) {
+                        repeat = 3 + inflate_bits(&inflater, 3);
+                    } else {
+                        repeat = 11 + inflate_bits(&inflater, 7);
+                    }
+                    if (i + repeat > literal_count + distance_count) return 0;
+                    while (repeat--) lengths[i++] = value;
+                }
+                if (lengths[256] == 0) return 0;
+            }
+            Huffman literals, distances;
+            if (!build_huffman(&literals, lengths, literal_count)) return 0;
+            if (!build_huffman(&distances, lengths + literal_count, distance_count)) return 0;
+            if (!inflate_codes(&inflater, &literals, &distances)) return 0;
+        } else {
+            return 0;
+        }
+        if (inflater.error) return 0;
+    } while (!last);
+    return inflater.out_position == out_size;
+}
+
+Uint32 read_big_endian(const unsigned char * bytes) {
+    return ((Uint32)bytes[0] << 24) | ((Uint32)bytes[1] << 16) | ((Uint32)bytes[2] << 8) | bytes[3];
+}
+
+// Decode a non-interlaced PNG of any colour type.
+int decode_png(unsigned char * data, size_t size, Image * image, char * message, int message_size) {
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    if (size < 8 || memcmp(data, signature, 8)) {
+        snprintf(message, message_size, "not a PNG file");
+        return 0;
+    }
+    int width = 0, height = 0, depth = 0, colour = 0, interlaced = 0;
+    unsigned char palette[256][4];
+    memset(palette, 255, sizeof(palette));
+    unsigned char * compressed = NULL;
+    size_t compressed_size = 0;
+    for (size_t at = 8; at + 12 <= size;) {
+        size_t length = read_big_endian(data + at);
+        const unsigned char * type = data + at + 4, * chunk = data + at + 8;
+        if (length > size - at - 12) break;
+        if (!memcmp(type, "IHDR", 4) && length >= 13) {
+            width = read_big_endian(chunk);
+            height = read_big_endian(chunk + 4);
+            depth = chunk[8];
+            colour = chunk[9];
+            interlaced = chunk[12];
+        } else if (!memcmp(type, "PLTE", 4)) {
+            for (size_t i = 0; i < length / 3 && i < 256; ++i) memcpy(palette[i], chunk + i * 3, 3);
+        } else if (!memcmp(type, "tRNS", 4) && colour == 3) {
+            for (size_t i = 0; i < length && i < 256; ++i) palette[i][3] = chunk[i];
+        } else if (!memcmp(type, "IDAT", 4)) {
+            unsigned char * grown = realloc(compressed, compressed_size + length);
+            if (!grown) break;
+            compressed = grown;
+            memcpy(compressed + compressed_size, chunk, length);
+            compressed_size += length;
+        } else if (!memcmp(type, "IEND", 4)) {
+            break;
+        }
+        at += length + 12;
+    }
+
+    static const int channels_for_colour[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    int channels = colour <= 6 ? channels_for_colour[colour] : 0;
+    if (width <= 0 || height <= 0 || width > 16384 || height > 16384 || !channels
+     || (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16)
+     || (depth < 8 && channels != 1) || interlaced || !compressed) {
+        free(compressed);
+        snprintf(message, message_size, "unsupported PNG (%dx%d, colour type %d, depth %d%s)",
+            width, height, colour, depth, interlaced ? ", interlaced" : "");
+        return 0;
+    }
+
+    // Each row is a filter type byte followed by the packed samples.
+    size_t stride = ((size_t)width * channels * depth + 7) / 8;
+    int pixel_bytes = (channels * depth + 7) / 8;
+    unsigned char * rows = malloc((stride + 1) * height);
+    image->pixels = malloc((size_t)width * height * 4);
+    if (!rows || !image->pixels
+     || !inflate_zlib(compressed, compressed_size, rows, (stride + 1) * height)) {
+        free(compressed);
+        free(rows);
+        free(image->pixels);
+        snprintf(message, message_size, "corrupt PNG data");
+        return 0;
+    }
+    free(compressed);
+
+    for (int y = 0; y < height; ++y) {
+        unsigned char * row = rows + y * (stride + 1) + 1;
+        unsigned char * above = y ? row - (stride + 1) : NULL;
+        int filter = row[-1];
+        for (size_t x = 0; x < stride; ++x) {
+            int left = x >= (size_t)pixel_bytes ? row[x - pixel_bytes] : 0;
+            int up = above ? above[x] : 0;
+            int up_left = above && x >= (size_t)pixel_bytes ? above[x - pixel_bytes] : 0;
+            if (filter == 1) row[x] += left;
+            else if (filter == 2) row[x] += up;
+            else if (filter == 3) row[x] += (left + up) / 2;
+            else if (filter == 4) {
+                int p = left + up - up_left;
+                int pa = abs(p - left), pb = abs(p - up), pc = abs(p - up_left);
+                row[x] += pa <= pb && pa <= pc ? left : pb <= pc ? up : up_left;
+            }
+        }
+
+        // Expand to RGBA, flipping so that the bottom row comes first.
+        unsigned char * out = image->pixels + (size_t)(height - 1 - y) * width * 4;
+        for (int x = 0; x < width; ++x, out += 4) {
+            int sample[4];
+            for (int c = 0; c < channels; ++c) {
+                if (depth == 16) {
+                    sample[c] = row[(x * channels + c) * 2];
+                } else if (depth == 8) {
+                    sample[c] = row[x * channels + c];
+                } else {
+                    int bit = x * depth;
+                    sample[c] = (row[bit / 8] >> (8 - depth - bit % 8)) & ((1 << depth) - 1);
+                    // Scale grey levels up to 8 bits; palette indices stay as they are.
+                    if (colour == 0) sample[c] = sample[c] * 255 / ((1 << depth) - 1);
+                }
+            }
+            if (colour == 3) {
+                memcpy(out, palette[sample[0]], 4);
+            } else if (channels <= 2) {
+                out[0] = out[1] = out[2] = sample[0];
+                out[3] = channels == 2 ? sample[1] : 255;
+            } else {
+                out[0] = sample[0];
+                out[1] = sample[1];
+                out[2] = sample[2];
+                out[3] = channels == 4 ? sample[3] : 255;
+            }
+        }
+    }
+    free(rows);
+    image->width = width;
+    image->height = height;
+    return 1;
+}
+
+// Decode a binary (P6) PPM, such as the ones fragger writes.
+int decode_ppm(unsigned char * data, size_t size, Image * image, char * message, int message_size) {
+    int width = 0, height = 0, maximum = 0, header_length = 0;
+    if (sscanf((char *)data, "P6 %d %d %d%n", &width, &height, &maximum, &header_length) != 3
+     || width <= 0 || height <= 0 || width > 16384 || height > 16384 || maximum != 255
+     || (size_t)header_length + 1 + (size_t)width * height * 3 > size) {
+        snprintf(message, message_size, "unsupported PPM (only 8-bit binary P6 is read)");
+        return 0;
+    }
+    const unsigned char * in = data + header_length + 1;
+    image->pixels = malloc((size_t)width * height * 4);
+    if (!image->pixels) panic_exit("Could not allocate space for an image.");
+    for (int y = 0; y < height; ++y) {
+        unsigned char * out = image->pixels + (size_t)(height - 1 - y) * width * 4;
+        for (int x = 0; x < width; ++x, in += 3, out += 4) {
+            out[0] = in[0];
+            out[1] = in[1];
+            out[2] = in[2];
+            out[3] = 255;
+        }
+    }
+    image->width = width;
+    image->height = height;
+    return 1;
+}
+
+// Load a PNG or PPM file. On failure this returns 0 with the reason in message.
+int load_image(char * file_name, Image * image, char * message, int message_size) {
+    FILE * file = fopen(file_name, "rb");
+    if (!file) {
+        snprintf(message, message_size, "Could not open file '%s'.", file_name);
+        return 0;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    unsigned char * data = malloc(size + 1);
+    if (!data) panic_exit("Could not allocate space for an image.");
+    size_t read = fread(data, 1, size, file);
+    fclose(file);
+    data[read] = '\0';
+
+    char reason[256];
+    int loaded = read >= 2 && data[0] == 'P' && data[1] == '6'
+        ? decode_ppm(data, read, image, reason, sizeof(reason))
+        : decode_png(data, read, image, reason, sizeof(reason));
+    free(data);
+    if (!loaded) snprintf(message, message_size, "Could not load image '%s': %s.", file_name, reason);
+    return loaded;
+}
+
+// A read-only memory mapping of a whole file.
+typedef struct {
+    unsigned char * data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file, mapping;
+#endif
+} MappedFile;
+
+int map_file(char * file_name, MappedFile * mapped) {
+    memset(mapped, 0, sizeof(*mapped));
+#ifdef _WIN32
+    mapped->file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mapped->file == INVALID_HANDLE_VALUE) return 0;
+    LARGE_INTEGER size;
+    mapped->mapping = GetFileSizeEx(mapped->file, &size) && size.QuadPart
+        ? CreateFileMappingA(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    mapped->data = mapped->mapping ? MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!mapped->data) {
+        if (mapped->mapping) CloseHandle(mapped->mapping);
+        CloseHandle(mapped->file);
+        return 0;
+    }
+    mapped->size = size.QuadPart;
+#else
+    int file = open(file_name, O_RDONLY);
+    if (file < 0) return 0;
+    struct stat info;
+    if (fstat(file, &info) || info.st_size == 0) {
+        close(file);
+        return 0;
+    }
+    void * data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED) return 0;
+    mapped->data = data;
+    mapped->size = info.st_size;
+#endif
+    return 1;
+}
+
+void unmap_file(MappedFile * mapped) {
+    if (!mapped->data) return;
+#ifdef _WIN32
+    UnmapViewOfFile(mapped->data);
+    CloseHandle(mapped->mapping);
+    CloseHandle(mapped->file);
+#else
+    munmap(mapped->data, mapped->size);
+#endif
+    memset(mapped, 0, sizeof(*mapped));
+}
+
+u64 hash_file(char * file_name) {
+    u64 hash = 0xcbf29ce484222325ull;
+    FILE * file = fopen(file_name, "rb");
+    if (!file) return hash;
+    unsigned char buffer[65536];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file))) hash = hash_bytes(hash, buffer, length);
+    fclose(file);
+    return hash;
+}
+
+// Decoded images are kept in the cache directory, so that an image that has
+// been loaded before is memory-mapped and uploaded straight from the mapping
+// instead of being decoded again. Entries are named by a hash of the image's
+// full path, and hold a header describing the source file followed by the
+// RGBA pixels. An entry is used if the source has the same size and either
+// the same modification time or (if it was touched or copied) the same
+// content hash. Modification times are only as fine as the file system keeps
+// them, so a source changed less than a second before its entry was written
+// is always hashed, since it could be rewritten without its time changing.
+// Using an entry marks it recent; once the cache is larger than its limit the
+// least recently used entries are deleted.
+#define TEXTURE_CACHE_MAGIC 0x32475246u
+#define TEXTURE_CACHE_LIMIT ((u64)512 << 20)
+#define TEXTURE_CACHE_EXTENSION ".tex"
+
+typedef struct {
+    Uint32 magic;
+    Uint32 width, height;
+    Uint32 reserved;
+    u64 source_size;
+    // Both in nanoseconds since the epoch.
+    u64 source_modified;
+    u64 written;
+    u64 source_hash;
+} TextureCacheHeader;
+
+#define NANOSECONDS_PER_SECOND 1000000000ull
+
+u64 modified_nanoseconds(struct stat * info) {
+#if defined(_WIN32)
+    return (u64)info->st_mtime * NANOSECONDS_PER_SECOND;
+#elif defined(__APPLE__)
+    return (u64)info->st_mtimespec.tv_sec * NANOSECONDS_PER_SECOND + info->st_mtimespec.tv_nsec;
+#else
+    return (u64)info->st_mtim.tv_sec * NANOSECONDS_PER_SECOND + info->st_mtim.tv_nsec;
+#endif
+}
+
+struct {
+    int enabled;
+    char directory[1024];
+} texture_cache;
+
+void texture_cache_init() {
+    texture_cache.enabled = find_cache_directory(texture_cache.directory, sizeof(texture_cache.directory));
+}
+
+void texture_cache_path(char * file_name, char * path, int path_size) {
+    char full_name[4096];
+#ifdef _WIN32
+    if (!_fullpath(full_name, file_name, sizeof(full_name))) snprintf(full_name, sizeof(full_name), "%s", file_name);
+#else
+    if (!realpath(file_name, full_name)) snprintf(full_name, sizeof(full_name), "%s", file_name);
+#endif
+    u64 key = hash_string(0xcbf29ce484222325ull, full_name);
+    snprintf(path, path_size, "%s/%016llx" TEXTURE_CACHE_EXTENSION, texture_cache.directory, (unsigned long long)key);
+}
+
+// Map a cached image. On success the image's pixels point into the mapping.
+int texture_cache_load(char * file_name, Image * image, MappedFile * mapped) {
+    struct stat source;
+    if (!texture_cache.enabled || stat(file_name, &source)) return 0;
+    char path[1100];
+    texture_cache_path(file_name, path, sizeof(path));
+    if (!map_file(path, mapped)) return 0;
+
+    TextureCacheHeader header;
+    int valid = mapped->size >= sizeof(header);
+    if (valid) {
+        memcpy(&header, mapped->data, sizeof(header));
+        valid = header.magic == TEXTURE_CACHE_MAGIC && header.width && header.height
+             && mapped->size == sizeof(header) + (size_t)header.width * header.height * 4
+             && header.source_size == (u64)source.st_size;
+    }
+    u64 modified = modified_nanoseconds(&source);
+    if (valid && (header.source_modified != modified
+               || header.written < header.source_modified + NANOSECONDS_PER_SECOND)) {
+        // Same size but touched since, or changed too recently to trust the
+        // time: compare the contents, and remember the time if they are
+        // unchanged so the next check is cheap again.
+        valid = header.source_hash == hash_file(file_name);
+        FILE * file = valid ? fopen(path, "r+b") : NULL;
+        if (file) {
+            header.source_modified = modified;
+            header.written = (u64)time(NULL) * NANOSECONDS_PER_SECOND;
+            fwrite(&header, sizeof(header), 1, file);
+            fclose(file);
+        }
+    }
+    if (!valid) {
+        unmap_file(mapped);
+        return 0;
+    }
+
+    // Mark the entry as recently used.
+    utime(path, NULL);
+
+    // Fault the pages in here, on the loader thread, rather than during upload.
+    volatile unsigned char touch = 0;
+    for (size_t i = 0; i < mapped->size; i += 4096) touch += mapped->data[i];
+
+    image->pixels = mapped->data + sizeof(header);
+    image->width = header.width;
+    image->height = header.height;
+    return 1;
+}
+
+// Write a decoded image to the cache (through a temporary file, renamed into
+// place so that a reader never maps half an entry).
+void texture_cache_store(char * file_name, Image * image) {
+    struct stat source;
+    if (!texture_cache.enabled || stat(file_name, &source)) return;
+    // The time written is rounded down, so the entry errs towards hashing.
+    TextureCacheHeader header = { TEXTURE_CACHE_MAGIC, image->width, image->height, 0,
+        source.st_size, modified_nanoseconds(&source), (u64)time(NULL) * NANOSECONDS_PER_SECOND,
+        hash_file(file_name) };
+    char path[1100], temporary_path[1200];
+    texture_cache_path(file_name, path, sizeof(path));
+    snprintf(temporary_path, sizeof(temporary_path), "%s.%u.tmp", path, (unsigned)SDL_GetTicks());
+    FILE * file = fopen(temporary_path, "wb");
+    if (!file) return;
+    size_t size = (size_t)image->width * image->height * 4;
+    int written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(image->pixels, 1, size, file) == size;
+    if (fclose(file) || !written) {
+        remove(temporary_path);
+    } else if (rename(temporary_path, path)) {
+        // Windows will not rename over an existing file.
+        remove(path);
+        if (rename(temporary_path, path)) remove(temporary_path);
+    }
+}
+
+typedef struct {
+    char name[256];
+    u64 size;
+    time_t modified;
+} CacheEntry;
+
+int compare_cache_entries(const void * a, const void * b) {
+    time_t x = ((const CacheEntry *)a)->modified, y = ((const CacheEntry *)b)->modified;
+    return (x > y) - (x < y);
+}
+
+// Delete the least recently used entries until the cache fits in its limit.
+void texture_cache_prune() {
+    if (!texture_cache.enabled) return;
+    DIR * directory = opendir(texture_cache.directory);
+    if (!directory) return;
+    CacheEntry * entries = NULL;
+    int count = 0;
+    u64 total = 0;
+    struct dirent * entry;
+    while ((entry = readdir(directory))) {
+        size_t length = strlen(entry->d_name);
+        size_t extension_length = strlen(TEXTURE_CACHE_EXTENSION);
+        if (length <= extension_length || length >= sizeof(entries->name)
+         || strcmp(entry->d_name + length - extension_length, TEXTURE_CACHE_EXTENSION)) {
+            continue;
+        }
+        char path[1400];
+        snprintf(path, sizeof(path), "%s/%s", texture_cache.directory, entry->d_name);
+        struct stat info;
+        if (stat(path, &info)) continue;
+        CacheEntry * grown = realloc(entries, (count + 1) * sizeof(CacheEntry));
+        if (!grown) break;
+        entries = grown;
+        strcpy(entries[count].name, entry->d_name);
+        entries[count].size = info.st_size;
+        entries[count].modified = info.st_mtime;
+        total += info.st_size;
+        ++count;
+    }
+    closedir(directory);
+
+    qsort(entries, count, sizeof(CacheEntry), compare_cache_entries);
+    for (int i = 0; i < count && total > TEXTURE_CACHE_LIMIT; ++i) {
+        char path[1400];
+        snprintf(path, sizeof(path), "%s/%s", texture_cache.directory, entries[i].name);
+        if (!remove(path)) total -= entries[i].size;
+    }
+    free(entries);
+}
+
+// Channels are images given on the command line, read by shaders through
+// samplers named channel0 to channel3. Images are decoded on a background
+// thread, then uploaded a slice of rows per frame through a pixel unpack
+// buffer, so neither startup nor the frame loop waits on a large image. Until
+// an image is complete its channel reads a 1x1 black placeholder; then
+// mipmaps are generated on the GPU and the real texture is bound instead.
+#define UPLOAD_SLICE_BYTES (4 << 20)
+
+typedef struct {
+    char * file_name;
+    GLuint texture;
+    // Written by the loader thread before the channel is queued.
+    // The pixels are either allocated, or point into a cached file.
+    Image image;
+    MappedFile mapped;
+    char message[1200];
+    int rows_uploaded;
+    int ready;
+} Channel;
+
+typedef struct {
+    Channel channels[CHANNEL_COUNT];
+    int pending;
+    GLuint placeholder;
+    GLuint upload_buffer;
+    // The channel being uploaded, or -1.
+    int uploading;
+    Queue decoded;
+    SDL_Thread * thread;
+} Channels;
+
+int channel_load_thread(void * data) {
+    Channels * channels = data;
+    int stored = 0;
+    for (int i = 0; i < CHANNEL_COUNT; ++i) {
+        Channel * channel = &channels->channels[i];
+        if (!channel->file_name) continue;
+        if (texture_cache_load(channel->file_name, &channel->image, &channel->mapped)) {
+            // Nothing to decode.
+        } else if (load_image(channel->file_name, &channel->image, channel->message, sizeof(channel->message))) {
+            texture_cache_store(channel->file_name, &channel->image);
+            stored = 1;
+        } else {
+            channel->image.pixels = NULL;
+        }
+        queue_push(&channels->decoded, i);
+    }
+    if (stored) texture_cache_prune();
+    return 0;
+}
 
-// Exit the program, displaying an error message via pop-up box and print out.
-void panic_exit(char * message, ...) {
-    va_list args;
-    va_start(args, message);
-    char buffer[512];
-    vsnprintf(buffer, 512, message, args);
-    va_end(args);
-    puts(buffer);
-    SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error!", buffer, NULL);
-    exit(1);
+// Start loading the channels (file_names may contain NULLs) and bind placeholders.
+void channels_start(Channels * channels, char ** file_names) {
+    memset(channels, 0, sizeof(*channels));
+    channels->uploading = -1;
+    unsigned char black[4] = { 0, 0, 0, 255 };
+    glGenTextures(1, &channels->placeholder);
+    glBindTexture(GL_TEXTURE_2D, channels->placeholder);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, black);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    for (int i = 0; i < CHANNEL_COUNT; ++i) {
+        glActiveTexture(GL_TEXTURE0 + CHANNEL_UNIT + i);
+        glBindTexture(GL_TEXTURE_2D, channels->placeholder);
+        channels->channels[i].file_name = file_names[i];
+        if (file_names[i]) ++channels->pending;
+    }
+    glActiveTexture(GL_TEXTURE0);
+    if (!channels->pending) return;
+
+    glGenBuffers(1, &channels->upload_buffer);
+    queue_init(&channels->decoded);
+    channels->thread = SDL_CreateThread(channel_load_thread, "channels", channels);
+    if (!channels->thread) panic_exit("Could not start the image loading thread.\n%s", SDL_GetError());
 }
 
-// Pseudo-random number generator.
-// (Xoroshiro128+)
-u64 random_seed[2] = { 0, 0 };
+// Called as each channel finishes loading, whether it succeeded or not.
+void channel_finished(Channels * channels) {
+    if (--channels->pending) return;
+    SDL_WaitThread(channels->thread, NULL);
+    glDeleteBuffers(1, &channels->upload_buffer);
+}
 
-u64 random_u64() {
-    u64 s0 = random_seed[0];
-    u64 s1 = random_seed[1];
-    u64 result = s0 + s1;
-    s1 ^= s0;
-    #define LS(x, k) ((x << k) | (x >> (64 - k)))
-    random_seed[0] = LS(s0, 55) ^ s1 ^ (s1 << 14);
-    random_seed[1] = LS(s1, 36);
-    #undef LS
-    return result;
+// Upload the next slice of a decoded image. If wait is set, block until an
+// image has been decoded rather than returning when there is none.
+void channels_update(Channels * channels, int wait) {
+    if (!channels->pending) return;
+    if (channels->uploading == -1) {
+        int index;
+        if (!queue_take(&channels->decoded, &index, wait)) return;
+        Channel * channel = &channels->channels[index];
+        if (!channel->image.pixels) {
+            printf("%s\n", channel->message);
+            channel_finished(channels);
+            return;
+        }
+        glGenTextures(1, &channel->texture);
+        glBindTexture(GL_TEXTURE_2D, channel->texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, channel->image.width, channel->image.height, 0,
+            GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        channels->uploading = index;
+    }
+
+    Channel * channel = &channels->channels[channels->uploading];
+    Image * image = &channel->image;
+    size_t row_size = (size_t)image->width * 4;
+    int rows = UPLOAD_SLICE_BYTES / row_size;
+    if (rows < 1) rows = 1;
+    if (rows > image->height - channel->rows_uploaded) rows = image->height - channel->rows_uploaded;
+
+    // Orphan the buffer each slice, so the driver never waits for the last one.
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, channels->upload_buffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, rows * row_size, NULL, GL_STREAM_DRAW);
+    void * slice = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, rows * row_size,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (!slice) panic_exit("Could not map an image upload buffer.");
+    memcpy(slice, image->pixels + channel->rows_uploaded * row_size, rows * row_size);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glBindTexture(GL_TEXTURE_2D, channel->texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, channel->rows_uploaded, image->width, rows,
+        GL_RGBA, GL_UNSIGNED_BYTE, (void *)0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    channel->rows_uploaded += rows;
+
+    if (channel->rows_uploaded == image->height) {
+        glGenerateMipmap(GL_TEXTURE_2D);
+        glActiveTexture(GL_TEXTURE0 + CHANNEL_UNIT + channels->uploading);
+        glBindTexture(GL_TEXTURE_2D, channel->texture);
+        glActiveTexture(GL_TEXTURE0);
+        if (channel->mapped.data) {
+            unmap_file(&channel->mapped);
+        } else {
+            free(image->pixels);
+        }
+        image->pixels = NULL;
+        channel->ready = 1;
+        channels->uploading = -1;
+        channel_finished(channels);
+    }
 }
 
-// Set the seed for the pseudo-random number generator.
-void set_seed(u64 a, u64 b) {
-    random_seed[0] = a;
-    random_seed[1] = b;
-    for (int i = 0; i < 64; ++i) random_u64();
+// Finish loading every channel. Exports and benchmarks use this so that their
+// frames never depend on how quickly images happened to load.
+void channels_wait(Channels * channels) {
+    while (channels->pending) channels_update(channels, 1);
 }
 
-// Get a random float between 0.0 and 1.0.
-float random_float() {
-    return (float)random_u64() / (float)UINT64_MAX;
+// A watcher notices when any of a pipeline's files has been saved. On Linux
+// it uses inotify on each file's directory, because many editors save by
+// writing a new file and renaming it over the old one, which would end a
+// watch on the file itself. Elsewhere (or if inotify is unavailable) it polls
+// the modification times.
+#define WATCH_POLL_INTERVAL 0.25
+#define WATCH_LIMIT (PASS_LIMIT + 1)
+
+typedef struct {
+    char file_names[WATCH_LIMIT][1024];
+    int file_count;
+    int inotify_fd;
+    int watches[WATCH_LIMIT];
+    time_t modified[WATCH_LIMIT];
+    long size[WATCH_LIMIT];
+    u64 last_poll;
+} Watcher;
+
+// Start watching a pipeline's files, replacing anything watched before.
+void watch_init(Watcher * watcher, Pipeline * pipeline) {
+#ifdef __linux__
+    if (watcher->file_count && watcher->inotify_fd >= 0) close(watcher->inotify_fd);
+#endif
+    memset(watcher, 0, sizeof(*watcher));
+    watcher->inotify_fd = -1;
+    watcher->last_poll = SDL_GetPerformanceCounter();
+    watcher->file_count = pipeline->pass_count;
+    for (int i = 0; i < watcher->file_count; ++i) {
+        snprintf(watcher->file_names[i], sizeof(watcher->file_names[i]), "%s", pipeline->passes[i].file_name);
+        struct stat info;
+        if (!stat(watcher->file_names[i], &info)) {
+            watcher->modified[i] = info.st_mtime;
+            watcher->size[i] = info.st_size;
+        }
+    }
+
+#ifdef __linux__
+    watcher->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (int i = 0; i < watcher->file_count && watcher->inotify_fd >= 0; ++i) {
+        // Watching the same directory twice gives the same watch descriptor.
+        char directory[1024];
+        snprintf(directory, sizeof(directory), "%s", watcher->file_names[i]);
+        char * slash = strrchr(directory, '/');
+        if (slash) {
+            slash[slash == directory] = '\0';
+        } else {
+            strcpy(directory, ".");
+        }
+        watcher->watches[i] = inotify_add_watch(watcher->inotify_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (watcher->watches[i] < 0) {
+            close(watcher->inotify_fd);
+            watcher->inotify_fd = -1;
+        }
+    }
+#endif
+}
+
+// Returns 1 if any file has changed since the last call. Never blocks.
+int watch_changed(Watcher * watcher) {
+    int changed = 0;
+#ifdef __linux__
+    if (watcher->inotify_fd >= 0) {
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t length;
+        while ((length = read(watcher->inotify_fd, events, sizeof(events))) > 0) {
+            for (char * at = events; at < events + length;) {
+                struct inotify_event * event = (struct inotify_event *)at;
+                for (int i = 0; i < watcher->file_count && event->len; ++i) {
+                    char * slash = strrchr(watcher->file_names[i], '/');
+                    char * base_name = slash ? slash + 1 : watcher->file_names[i];
+                    if (event->wd == watcher->watches[i] && !strcmp(event->name, base_name)) changed = 1;
+                }
+                at += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        return changed;
+    }
+#endif
+    u64 now = SDL_GetPerformanceCounter();
+    if (seconds_between(watcher->last_poll, now) < WATCH_POLL_INTERVAL) return 0;
+    watcher->last_poll = now;
+    for (int i = 0; i < watcher->file_count; ++i) {
+        struct stat info;
+        if (stat(watcher->file_names[i], &info)) continue;
+        changed |= info.st_mtime != watcher->modified[i] || info.st_size != watcher->size[i];
+        watcher->modified[i] = info.st_mtime;
+        watcher->size[i] = info.st_size;
+    }
+    return changed;
+}
+
+// A reloader rebuilds the pipeline on a worker thread with a shared context,
+// so the frame loop keeps drawing with the old programs while the driver
+// compiles. Each build is handed back through a queue and swapped in by the
+// main thread; if the build failed, the old pipeline stays.
+#define RELOAD_DONE -1
+
+typedef struct {
+    char * file_name;
+    SharedContext context;
+    // NULL if the pipeline is rebuilt on the main thread instead.
+    SDL_Thread * thread;
+    Queue started, requests, results;
+    // Set while a request is queued or being built.
+    int busy;
+    // A file changed again while busy, so build once more afterwards.
+    int again;
+    // Written by the worker before it pushes a result.
+    Pipeline pipeline;
+    char message[4096];
+    double seconds;
+} Reloader;
+
+int reload_thread(void * data) {
+    Reloader * reloader = data;
+    int bound = make_context_current(&reloader->context);
+    queue_push(&reloader->started, bound);
+    if (!bound) return 0;
+    GLuint vertex_array = create_fullscreen_quad();
+    Target target = create_target(1, 1, GL_RGBA8);
+    glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+    glViewport(0, 0, 1, 1);
+    while (queue_pop(&reloader->requests) != RELOAD_DONE) {
+        u64 start = SDL_GetPerformanceCounter();
+        Pipeline * pipeline = &reloader->pipeline;
+        int built = build_pipeline(pipeline, reloader->file_name, reloader->message, sizeof(reloader->message));
+        // Many drivers only finish compiling when a program is first drawn
+        // with, so draw once here rather than stalling the frame loop later.
+        for (int i = 0; built && i < pipeline->pass_count; ++i) {
+            glUseProgram(pipeline->passes[i].program);
+            glBindVertexArray(vertex_array);
+            glDrawArrays(GL_TRIANGLES, 0, 6);
+        }
+        glUseProgram(0);
+        // The programs must be complete before another context uses them.
+        glFinish();
+        reloader->seconds = seconds_between(start, SDL_GetPerformanceCounter());
+        queue_push(&reloader->results, built);
+    }
+    destroy_target(&target);
+    glDeleteVertexArrays(1, &vertex_array);
+    make_context_current(NULL);
+    return 0;
+}
+
+void reload_start(Reloader * reloader, char * file_name) {
+    memset(reloader, 0, sizeof(*reloader));
+    reloader->file_name = file_name;
+    queue_init(&reloader->started);
+    queue_init(&reloader->requests);
+    queue_init(&reloader->results);
+    reloader->context = create_shared_context();
+    if (reloader->context.context) {
+        reloader->thread = start_context_thread(reload_thread, "reload", reloader, &reloader->started);
+    }
+    if (!reloader->thread) {
+        printf("Could not use a shared OpenGL context, so shaders are rebuilt on the main thread.\n");
+        destroy_shared_context(&reloader->context);
+    }
+}
+
+void reload_request(Reloader * reloader) {
+    if (reloader->busy) {
+        reloader->again = 1;
+        return;
+    }
+    reloader->busy = 1;
+    if (reloader->thread) {
+        queue_push(&reloader->requests, 0);
+        return;
+    }
+    // Without a worker, build here; the result is still picked up by
+    // reload_poll. The programs are made in the main context, so they need
+    // no finishing before use.
+    u64 start = SDL_GetPerformanceCounter();
+    int built = build_pipeline(&reloader->pipeline, reloader->file_name, reloader->message, sizeof(reloader->message));
+    reloader->seconds = seconds_between(start, SDL_GetPerformanceCounter());
+    queue_push(&reloader->results, built);
+}
+
+// Returns 1 and moves a newly built pipeline into pipeline, or returns 0 if
+// there is none yet or the build failed.
+int reload_poll(Reloader * reloader, Pipeline * pipeline) {
+    int built;
+    if (!queue_take(&reloader->results, &built, 0)) return 0;
+    reloader->busy = 0;
+    if (built) {
+        printf("Reloaded '%s' in %.1f ms.\n", reloader->file_name, reloader->seconds * 1000.0);
+        *pipeline = reloader->pipeline;
+    } else {
+        printf("%s\n", reloader->message);
+    }
+    if (reloader->again) {
+        reloader->again = 0;
+        reload_request(reloader);
+    }
+    return built;
+}
+
+void reload_finish(Reloader * reloader) {
+    if (reloader->thread) {
+        queue_push(&reloader->requests, RELOAD_DONE);
+        SDL_WaitThread(reloader->thread, NULL);
+        destroy_shared_context(&reloader->context);
+    }
+    int built;
+    if (queue_take(&reloader->results, &built, 0) && built) destroy_pipeline(&reloader->pipeline);
+}
+
+// The pacer decides when each windowed frame starts.
+//
+// With vsync, swapping already waits for the display, so drawing straight
+// away only means the frame sits finished (showing old input) until the next
+// refresh. Instead the pacer sleeps through the predicted slack: one refresh
+// after the last swap, less the time a frame is expected to take and a safety
+// margin. The margin grows whenever a refresh is missed and slowly shrinks
+// while none are.
+//
+// With a frame rate cap, frames start on a fixed schedule. Sleeping is coarse
+// (SDL_Delay often oversleeps by a millisecond or more), so the pacer sleeps
+// until just before the deadline and spins for the rest, learning how much
+// to leave for spinning from how late the sleeps wake up.
+//
+// Unthrottled, frames are drawn back to back.
+//
+// In every mode the time between presented frames is recorded, to report
+// how evenly they were paced.
+typedef enum { PACING_VSYNC, PACING_CAP, PACING_OFF } PacingMode;
+
+typedef struct {
+    PacingMode mode;
+    // The time between frames that the pacer aims for.
+    double period;
+    // When the next capped frame should start.
+    u64 deadline;
+    // When the last frame was presented, or 0 after a pause.
+    u64 last_present;
+    // When the current frame started drawing.
+    u64 wake;
+    // Predicted seconds from starting a frame to presenting it.
+    double work;
+    double margin;
+    int on_time;
+    // How late SDL_Delay tends to wake.
+    double oversleep;
+    // Statistics of the intervals between presented frames.
+    int count, missed;
+    double sum, sum_squares, worst;
+} Pacer;
+
+#define PACING_MIN_MARGIN 0.001
+#define PACING_MIN_OVERSLEEP 0.0005
+#define PACING_MAX_OVERSLEEP 0.004
+
+void pace_init(Pacer * pacer, PacingMode mode, double rate) {
+    memset(pacer, 0, sizeof(*pacer));
+    pacer->mode = mode;
+    pacer->period = rate > 0.0 ? 1.0 / rate : 0.0;
+    pacer->margin = 0.002;
+    pacer->oversleep = 0.002;
+}
+
+// Sleep until a performance counter value, spinning for the last part.
+void pace_sleep_until(Pacer * pacer, u64 deadline) {
+    u64 now = SDL_GetPerformanceCounter();
+    if (now >= deadline) return;
+    double remaining = seconds_between(now, deadline);
+    if (remaining > pacer->oversleep) {
+        Uint32 milliseconds = (Uint32)((remaining - pacer->oversleep) * 1000.0);
+        if (milliseconds) {
+            u64 sleep_start = SDL_GetPerformanceCounter();
+            SDL_Delay(milliseconds);
+            double late = seconds_between(sleep_start, SDL_GetPerformanceCounter()) - milliseconds / 1000.0;
+            // Rise quickly after a late wake, fall slowly after good ones.
+            // One very late wake (the process was descheduled) must not
+            // leave the pacer spinning through whole frames.
+            double weight = late > pacer->oversleep ? 0.5 : 0.01;
+            pacer->oversleep += (late - pacer->oversleep) * weight;
+            if (pacer->oversleep < PACING_MIN_OVERSLEEP) pacer->oversleep = PACING_MIN_OVERSLEEP;
+            if (pacer->oversleep > PACING_MAX_OVERSLEEP) pacer->oversleep = PACING_MAX_OVERSLEEP;
+        }
+    }
+    while (SDL_GetPerformanceCounter() < deadline) {}
+}
+
+// Forget the timing of earlier frames, such as after waiting for events, so
+// the next frame starts straight away and the pause is not counted.
+void pace_reset(Pacer * pacer) {
+    pacer->last_present = 0;
+    pacer->deadline = 0;
+}
+
+// Wait until the next frame should start.
+void pace_wait(Pacer * pacer) {
+    u64 frequency = SDL_GetPerformanceFrequency();
+    u64 now = SDL_GetPerformanceCounter();
+    if (pacer->mode == PACING_CAP) {
+        u64 period = (u64)(pacer->period * frequency);
+        // Keep to the schedule, unless a frame ran so late it cannot be kept.
+        if (!pacer->deadline || now > pacer->deadline + period) pacer->deadline = now;
+        pace_sleep_until(pacer, pacer->deadline);
+        pacer->deadline += period;
+    } else if (pacer->mode == PACING_VSYNC && pacer->last_present) {
+        double slack = pacer->period - pacer->work - pacer->margin;
+        if (slack > 0.0) pace_sleep_until(pacer, pacer->last_present + (u64)(slack * frequency));
+    }
+    pacer->wake = SDL_GetPerformanceCounter();
+}
+
+// Record that a frame has just been presented, having called the swap at
+// swap_start.
+void pace_presented(Pacer * pacer, u64 swap_start) {
+    u64 now = SDL_GetPerformanceCounter();
+    if (pacer->last_present) {
+        double interval = seconds_between(pacer->last_present, now);
+        ++pacer->count;
+        pacer->sum += interval;
+        pacer->sum_squares += interval * interval;
+        if (interval > pacer->worst) pacer->worst = interval;
+        int missed = pacer->period > 0.0 && interval > pacer->period * 1.5;
+        pacer->missed += missed;
+
+        if (pacer->mode == PACING_VSYNC) {
+            // Only the time until the swap was called is work: after that
+            // the swap may be waiting for the display. The GPU's share is
+            // left to the margin, which grows whenever a refresh is missed.
+            // Predict with a decaying maximum rather than an average, as
+            // one slow frame costs a whole refresh.
+            double work = seconds_between(pacer->wake, swap_start);
+            pacer->work = work > pacer->work ? work : pacer->work * 0.95 + work * 0.05;
+            if (missed) {
+                pacer->margin += 0.001;
+                if (pacer->margin > pacer->period) pacer->margin = pacer->period;
+                pacer->on_time = 0;
+            } else if (++pacer->on_time >= 120) {
+                pacer->margin -= 0.00025;
+                if (pacer->margin < PACING_MIN_MARGIN) pacer->margin = PACING_MIN_MARGIN;
+                pacer->on_time = 0;
+            }
+        }
+    }
+    pacer->last_present = now;
+}
+
+void pace_report(Pacer * pacer) {
+    static char * names[] = { "vsync", "cap", "off" };
+    printf("Pacing (%s", names[pacer->mode]);
+    if (pacer->period > 0.0) printf(", %.1f Hz", 1.0 / pacer->period);
+    printf("): ");
+    if (!pacer->count) {
+        printf("no frames measured.\n");
+        return;
+    }
+    double mean = pacer->sum / pacer->count;
+    double variance = pacer->sum_squares / pacer->count - mean * mean;
+    printf("%d frames, interval mean %.3f ms, jitter %.3f ms (standard deviation), worst %.3f ms, %d missed.\n",
+        pacer->count, mean * 1000.0, SDL_sqrt(variance > 0.0 ? variance : 0.0) * 1000.0,
+        pacer->worst * 1000.0, pacer->missed);
+}
+
+// The driver may queue several frames before the GPU draws them, so with a
+// heavy shader the mouse can reach the screen frames late. The limiter puts a
+// fence after each swap and, once a limit of frames are in flight, waits for
+// the oldest to finish. Time spent waiting means the GPU is the bottleneck.
+#define FRAMES_IN_FLIGHT_LIMIT 3
+
+typedef struct {
+    int limit;
+    GLsync fences[FRAMES_IN_FLIGHT_LIMIT];
+    int next;
+    // Statistics of the waits.
+    int frames;
+    u64 first_frame, last_frame;
+    double wait_seconds, worst_wait;
+} FrameLimiter;
+
+void limit_init(FrameLimiter * limiter, int limit) {
+    memset(limiter, 0, sizeof(*limiter));
+    limiter->limit = limit;
+}
+
+// Call after each swap.
+void limit_frame(FrameLimiter * limiter) {
+    limiter->fences[limiter->next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    limiter->next = (limiter->next + 1) % limiter->limit;
+
+    // The slot for the next fence holds the oldest frame still in flight.
+    GLsync oldest = limiter->fences[limiter->next];
+    u64 start = SDL_GetPerformanceCounter();
+    if (oldest) {
+        while (glClientWaitSync(oldest, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+        glDeleteSync(oldest);
+        limiter->fences[limiter->next] = 0;
+    }
+    u64 end = SDL_GetPerformanceCounter();
+    double seconds = seconds_between(start, end);
+    limiter->wait_seconds += seconds;
+    if (seconds > limiter->worst_wait) limiter->worst_wait = seconds;
+    if (!limiter->frames++) limiter->first_frame = start;
+    limiter->last_frame = end;
+}
+
+void limit_finish(FrameLimiter * limiter) {
+    for (int i = 0; i < FRAMES_IN_FLIGHT_LIMIT; ++i) {
+        if (limiter->fences[i]) glDeleteSync(limiter->fences[i]);
+    }
+}
+
+void limit_report(FrameLimiter * limiter) {
+    if (!limiter->frames) return;
+    double total = seconds_between(limiter->first_frame, limiter->last_frame);
+    printf("Frames in flight (at most %d): waited for the GPU %.3f ms per frame on average "
+        "(%.1f%% of the time), worst %.3f ms.\n",
+        limiter->limit, limiter->wait_seconds * 1000.0 / limiter->frames,
+        total > 0.0 ? limiter->wait_seconds * 100.0 / total : 0.0, limiter->worst_wait * 1000.0);
+}
+
+// The mouse is read again just before drawing, so a frame uses the newest
+// position rather than whichever motion event was handled last. Optionally
+// the position is predicted a little ahead from its recent velocity, to make
+// up for the time the frame takes to reach the screen.
+typedef struct {
+    // Seconds to predict ahead, or 0.
+    double horizon;
+    float x, y;
+    float velocity_x, velocity_y;
+    u64 time;
+} MouseLatch;
+
+// Read the mouse into the mouse uniform, in drawable pixels with y upwards.
+void mouse_latch(MouseLatch * latch, float scale, int width, int height, float * x, float * y) {
+    // Bring SDL's idea of the mouse up to date with the system's.
+    SDL_PumpEvents();
+    int window_x, window_y;
+    SDL_GetMouseState(&window_x, &window_y);
+    u64 now = SDL_GetPerformanceCounter();
+    float new_x = (int)(window_x * scale);
+    float new_y = (int)(height - window_y * scale);
+
+    if (latch->time) {
+        double seconds = seconds_between(latch->time, now);
+        if (seconds > 0.0) {
+            // Smooth the velocity a little, as samples arrive unevenly.
+            latch->velocity_x = latch->velocity_x * 0.5f + (new_x - latch->x) / seconds * 0.5f;
+            latch->velocity_y = latch->velocity_y * 0.5f + (new_y - latch->y) / seconds * 0.5f;
+        }
+    }
+    latch->x = new_x;
+    latch->y = new_y;
+    latch->time = now;
+
+    *x = new_x + latch->velocity_x * latch->horizon;
+    *y = new_y + latch->velocity_y * latch->horizon;
+    // Never predict past the edge of the window.
+    if (*x < 0.0f) *x = 0.0f;
+    if (*x > width) *x = width;
+    if (*y < 0.0f) *y = 0.0f;
+    if (*y > height) *y = height;
+}
+
+// The latency test stamps each frame with the time its input was read: a
+// small patch in the bottom left corner whose colour holds the time in units
+// of 0.1 ms (24 bits, so it wraps every 28 minutes). Once the frame has been
+// swapped, the patch is read back from the front buffer and the difference to
+// the current time is the input to display latency of whichever frame is
+// actually showing. The patch can also be filmed to measure it with a camera.
+#define LATENCY_PATCH_SIZE 8
+#define LATENCY_UNITS_PER_SECOND 10000
+
+typedef struct {
+    Samples milliseconds;
+} LatencyTest;
+
+Uint32 latency_units(u64 counter) {
+    return (Uint32)(counter * LATENCY_UNITS_PER_SECOND / SDL_GetPerformanceFrequency()) & 0xffffff;
+}
+
+// Draw the stamp into the bound framebuffer.
+void latency_stamp(u64 input_time) {
+    Uint32 units = latency_units(input_time);
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(0, 0, LATENCY_PATCH_SIZE, LATENCY_PATCH_SIZE);
+    glClearColor((units >> 16) / 255.0f, ((units >> 8) & 0xff) / 255.0f, (units & 0xff) / 255.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glDisable(GL_SCISSOR_TEST);
+}
+
+// Read the stamp of the frame being shown (from a framebuffer when headless).
+void latency_measure(LatencyTest * test, GLuint framebuffer) {
+    unsigned char pixel[4];
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+    if (!framebuffer) glReadBuffer(GL_FRONT);
+    glReadPixels(LATENCY_PATCH_SIZE / 2, LATENCY_PATCH_SIZE / 2, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixel);
+    if (!framebuffer) glReadBuffer(GL_BACK);
+    Uint32 stamp = pixel[0] << 16 | pixel[1] << 8 | pixel[2];
+    Uint32 elapsed = (latency_units(SDL_GetPerformanceCounter()) - stamp) & 0xffffff;
+    samples_add(&test->milliseconds, elapsed * 1000.0 / LATENCY_UNITS_PER_SECOND);
+}
+
+void latency_report(LatencyTest * test) {
+    Stats stats = summarise(&test->milliseconds);
+    printf("Latency from input to display over %d frames: mean %.1f ms, p50 %.1f ms, p95 %.1f ms, "
+        "p99 %.1f ms, max %.1f ms.\n", test->milliseconds.count,
+        stats.mean, stats.p50, stats.p95, stats.p99, stats.max);
 }
 
 int main(int argument_count, char ** arguments) {
@@ -65,79 +4204,408 @@ int main(int argument_count, char ** arguments) {
     // Handle program arguments.
     int retina_mode = 0;
     int debug_mode = 0;
+    int profile_mode = 0;
+    int cache_mode = 1;
+    char * channel_file_names[CHANNEL_COUNT] = { 0 };
+    char * profile_csv = NULL;
+    int headless_mode = 0;
+    int bench_mode = 0;
+    char * report_file_name = NULL;
+    int width = 0, height = 0;
+    int requested_width = 640, requested_height = 480;
+    int frame_limit = 0;
+    float frame_rate = 60.0f;
+    char * export_pattern = NULL;
+    char * stream_path = NULL;
+    char * stream_format = NULL;
+    int drop_frames = 0;
+    int gpu_yuv = 0;
+    char * capture_pattern = "capture_%05d.tga";
+    int capture_at_frame = -1;
+    char * pacing_name = NULL;
+    char * present_name = NULL;
+    float max_frame_rate = 0.0f;
+    int frames_in_flight = 2;
+    float predict_milliseconds = 0.0f;
+    int latency_test = 0;
+    float render_scale = 1.0f;
+    float frame_budget = 0.0f;
+    int sharpen = 0;
+    float progressive_slice = 0.0f;
+    int accumulate_limit = 0;
+    char * aa_name = NULL;
+    float aa_threshold = 0.1f;
+    int poster_width = 0, poster_height = 0;
+    char * poster_file_name = "poster.ppm";
+    float poster_time = 0.0f;
     char * frag_file_name = NULL;
 
+    Bench bench = { 0 };
+    bench.warmup_frames = 30;
+
+    Suite suite = { 0 };
+    suite.threshold = 10.0f;
+
     if (argument_count > 1) {
         for (int i = 1; i < argument_count; ++i) {
             if (arguments[i][0] == '-') {
-                if (arguments[i][1] == 'r') retina_mode = 1; else
-                if (arguments[i][1] == 'd') debug_mode = 1;
+                // Long options that take a value consume the next argument.
+                char * value = i + 1 < argument_count ? arguments[i + 1] : "";
+                if (!strcmp(arguments[i], "--headless")) {
+                    if (sscanf(value, "%dx%d", &width, &height) != 2 || width < 1 || height < 1) {
+                        panic_exit("Invalid headless size '%s', expected WIDTHxHEIGHT.", value);
+                    }
+                    headless_mode = 1;
+                    ++i;
+                } else if (!strcmp(arguments[i], "--size")) {
+                    if (sscanf(value, "%dx%d", &requested_width, &requested_height) != 2
+                     || requested_width < 1 || requested_height < 1) {
+                        panic_exit("Invalid window size '%s', expected WIDTHxHEIGHT.", value);
+                    }
+                    ++i;
+                } else if (!strcmp(arguments[i], "--bench")) {
+                    bench_mode = 1;
+                } else if (!strcmp(arguments[i], "--warmup")) {
+                    bench.warmup_frames = atoi(value);
+                    ++i;
+                } else if (!strcmp(arguments[i], "--duration")) {
+                    bench.duration = atof(value);
+                    ++i;
+                } else if (!strcmp(arguments[i], "--report")) {
+                    report_file_name = value;
+                    ++i;
+                } else if (!strncmp(arguments[i], "--channel", 9)
+                        && arguments[i][9] >= '0' && arguments[i][9] < '0' + CHANNEL_COUNT
+                        && !arguments[i][10]) {
+                    channel_file_names[arguments[i][9] - '0'] = value;
+                    ++i;
+                } else if (!strcmp(arguments[i], "--no-cache")) {
+                    cache_mode = 0;
+                } else if (!strcmp(arguments[i], "--suite")) {
+                    suite.directory = value;
+                    ++i;
+                } else if (!strcmp(arguments[i], "--baseline")) {
+                    suite.baseline_file_name = value;
+                    ++i;
+                } else if (!strcmp(arguments[i], "--threshold")) {
+                    suite.threshold = atof(value);
+                    ++i;
+                } else if (!strcmp(arguments[i], "--update-baseline")) {
+                    suite.update = 1;
+                } else if (!strcmp(arguments[i], "--frames")) {
+                    frame_limit = atoi(value);
+                    ++i;
+                } else if (!strcmp(arguments[i], "--fps")) {
+                    frame_rate = atof(value);
+                    if (frame_rate <= 0.0f) panic_exit("Invalid frame rate '%s'.", value);
+                    ++i;
+                } else if (!strcmp(arguments[i], "--export")) {
+                    export_pattern = value;
+                    ++i;
+                } else if (!strcmp(arguments[i], "--stream")) {
+                    stream_path = value;
+                    ++i;
+                } else if (!strcmp(arguments[i], "--stream-format")) {
+                    stream_format = value;
+                    ++i;
+                } else if (!strcmp(arguments[i], "--drop")) {
+                    drop_frames = 1;
+                } else if (!strcmp(arguments[i], "--gpu-yuv")) {
+                    gpu_yuv = 1;
+                } else if (!strcmp(arguments[i], "--profile-csv")) {
+                    profile_csv = value;
+                    profile_mode = 1;
+                    ++i;
+                } else if (!strcmp(arguments[i], "--capture")) {
+                    capture_at_frame = atoi(value);
+                    ++i;
+                } else if (!strcmp(arguments[i], "--capture-file")) {
+                    capture_pattern = value;
+                    ++i;
+                } else if (!strcmp(arguments[i], "--present")) {
+                    present_name = value;
+                    ++i;
+                } else if (!strcmp(arguments[i], "--frames-in-flight")) {
+                    frames_in_flight = atoi(value);
+                    if (frames_in_flight < 1 || frames_in_flight > FRAMES_IN_FLIGHT_LIMIT) {
+                        panic_exit("Invalid frames in flight '%s', expected 1 to %d.", value, FRAMES_IN_FLIGHT_LIMIT);
+                    }
+                    ++i;
+                } else if (!strcmp(arguments[i], "--predict")) {
+                    predict_milliseconds = atof(value);
+                    if (predict_milliseconds < 0.0f) panic_exit("Invalid prediction time '%s'.", value);
+                    ++i;
+                } else if (!strcmp(arguments[i], "--latency-test")) {
+                    latency_test = 1;
+                } else if (!strcmp(arguments[i], "--scale")) {
+                    render_scale = atof(value);
+                    if (render_scale <= 0.0f || render_scale > 1.0f) {
+                        panic_exit("Invalid scale '%s', expected more than 0 and at most 1.", value);
+                    }
+                    ++i;
+                } else if (!strcmp(arguments[i], "--budget")) {
+                    frame_budget = atof(value);
+                    if (frame_budget <= 0.0f) panic_exit("Invalid frame time budget '%s'.", value);
+                    ++i;
+                } else if (!strcmp(arguments[i], "--upscale")) {
+                    if (!strcmp(value, "sharpen")) sharpen = 1; else
+                    if (strcmp(value, "bilinear")) panic_exit("Unknown upscale filter '%s', expected bilinear or sharpen.", value);
+                    ++i;
+                } else if (!strcmp(arguments[i], "--progressive")) {
+                    progressive_slice = atof(value);
+                    if (progressive_slice <= 0.0f) panic_exit("Invalid time slice '%s'.", value);
+                    ++i;
+                } else if (!strcmp(arguments[i], "--accumulate")) {
+                    accumulate_limit = atoi(value);
+                    if (accumulate_limit < 1) panic_exit("Invalid sample count '%s'.", value);
+                    ++i;
+                } else if (!strcmp(arguments[i], "--aa")) {
+                    aa_name = value;
+                    ++i;
+                } else if (!strcmp(arguments[i], "--aa-threshold")) {
+                    aa_threshold = atof(value);
+                    if (aa_threshold <= 0.0f) panic_exit("Invalid contrast threshold '%s'.", value);
+                    ++i;
+                } else if (!strcmp(arguments[i], "--poster")) {
+                    if (sscanf(value, "%dx%d", &poster_width, &poster_height) != 2
+                     || poster_width < 1 || poster_height < 1) {
+                        panic_exit("Invalid poster size '%s', expected WIDTHxHEIGHT.", value);
+                    }
+                    ++i;
+                } else if (!strcmp(arguments[i], "--poster-file")) {
+                    poster_file_name = value;
+                    ++i;
+                } else if (!strcmp(arguments[i], "--poster-time")) {
+                    poster_time = atof(value);
+                    ++i;
+                } else if (!strcmp(arguments[i], "--pacing")) {
+                    pacing_name = value;
+                    ++i;
+                } else if (!strcmp(arguments[i], "--max-fps")) {
+                    max_frame_rate = atof(value);
+                    if (max_frame_rate <= 0.0f) panic_exit("Invalid frame rate '%s'.", value);
+                    ++i;
+                } else if (arguments[i][1] == 'r') {
+                    retina_mode = 1;
+                } else if (arguments[i][1] == 'd') {
+                    debug_mode = 1;
+                } else if (arguments[i][1] == 'p') {
+                    profile_mode = 1;
+                }
             } else {
                 if (!frag_file_name) frag_file_name = arguments[i];
             }
         }
     }
 
+    // A suite benchmarks each shader in a separate process, then exits.
+    if (suite.directory) {
+        static char baseline_file_name[1024];
+        if (!suite.baseline_file_name) {
+            snprintf(baseline_file_name, sizeof(baseline_file_name), "%s/baseline.txt", suite.directory);
+            suite.baseline_file_name = baseline_file_name;
+        }
+        suite.width = headless_mode ? width : 640;
+        suite.height = headless_mode ? height : 360;
+        suite.frames = frame_limit > 0 ? frame_limit : 300;
+        suite.warmup_frames = bench.warmup_frames;
+        return run_suite(&suite, arguments[0]);
+    }
+
     // If no file was given, fall back to the default.
     if (!frag_file_name) frag_file_name = "frag.glsl";
 
+    // A poster needs no window, and is drawn in tiles with gl_FragCoord moved.
+    if (poster_width) {
+        if (is_stream_format(image_format_for(poster_file_name))) {
+            panic_exit("Posters can only be written to .ppm or .tga files.");
+        }
+#ifdef HEADLESS_SUPPORTED
+        if (!headless_mode) {
+            headless_mode = 1;
+            width = height = 1;
+        }
+#endif
+        fragcoord_offset_enabled = 1;
+    }
+
+    // The anti-aliasing mode. Adaptive anti-aliasing moves gl_FragCoord to
+    // draw the extra samples.
+    AntialiasMode aa_mode = AA_NONE;
+    int aa_factor = 0;
+    if (aa_name && sscanf(aa_name, "ssaa%d", &aa_factor) == 1) {
+        if (aa_factor < 2 || aa_factor > 4) panic_exit("Invalid supersampling mode '%s', expected ssaa2 to ssaa4.", aa_name);
+        aa_mode = AA_SSAA;
+    } else if (aa_name && !strcmp(aa_name, "edge")) {
+        aa_mode = AA_EDGE;
+    } else if (aa_name && !strcmp(aa_name, "adaptive")) {
+        aa_mode = AA_ADAPTIVE;
+        fragcoord_offset_enabled = 1;
+    } else if (aa_name && strcmp(aa_name, "none")) {
+        panic_exit("Unknown anti-aliasing mode '%s', expected none, ssaa2, ssaa3, ssaa4, edge or adaptive.", aa_name);
+    }
+    if (aa_mode && (poster_width || progressive_slice || accumulate_limit || render_scale < 1.0f || frame_budget)) {
+        panic_exit("--aa cannot be combined with posters, scaling, --progressive or --accumulate.");
+    }
+
+    // A benchmark measures a fixed number of frames, unless it has a duration.
+    if (bench_mode && frame_limit <= 0 && !bench.duration) frame_limit = 300;
+    if (bench_mode && frame_limit > 0) frame_limit += bench.warmup_frames;
+    if (bench_mode) profile_mode = 1;
+
+    // There is nobody to close a headless session, so it always has an end:
+    // by default, once every sample has been accumulated.
+    if (headless_mode && frame_limit <= 0 && !bench.duration) frame_limit = accumulate_limit ? accumulate_limit : 60;
+
+    // Work out where exported or streamed frames go, and in which format.
+    if (export_pattern && stream_path) panic_exit("Only one of --export and --stream can be used.");
+    ImageFormat export_format = IMAGE_PPM;
+    if (export_pattern) export_format = image_format_for(export_pattern);
+    if (stream_path) {
+        export_pattern = stream_path;
+        export_format = image_format_for(stream_path);
+        if (!is_stream_format(export_format)) export_format = IMAGE_RGBA;
+        if (stream_format && !strcmp(stream_format, "y4m")) export_format = IMAGE_Y4M; else
+        if (stream_format && !strcmp(stream_format, "rgba")) export_format = IMAGE_RGBA; else
+        if (stream_format && !strcmp(stream_format, "i420")) export_format = IMAGE_I420; else
+        if (stream_format && !strcmp(stream_format, "nv12")) export_format = IMAGE_NV12; else
+        if (stream_format) panic_exit("Unknown stream format '%s', expected rgba, y4m, i420 or nv12.", stream_format);
+        // Keep anything we print out of the stream.
+        if (!strcmp(stream_path, "-")) claim_stdout();
+    }
+    if (progressive_slice && (export_pattern || bench_mode || render_scale < 1.0f || frame_budget)) {
+        panic_exit("--progressive cannot be combined with exporting, streaming, benchmarks or scaling.");
+    }
+    if (accumulate_limit && (export_pattern || bench_mode || render_scale < 1.0f || frame_budget || progressive_slice)) {
+        panic_exit("--accumulate cannot be combined with exporting, streaming, benchmarks, scaling or --progressive.");
+    }
+    if (gpu_yuv && !(stream_path && is_yuv_format(export_format))) {
+        panic_exit("--gpu-yuv only applies when streaming y4m, i420 or nv12.");
+    }
+
+    // Offline output advances time by a fixed step per frame instead of
+    // following the clock, so every frame is the same regardless of render speed.
+    int fixed_timestep = export_pattern != NULL || bench_mode;
+
+    // Windowed frames wait for the display by default, or for a frame rate
+    // cap if one is given. Benchmarks are never held back.
+    PacingMode pacing_mode = max_frame_rate > 0.0f ? PACING_CAP : PACING_VSYNC;
+    if (pacing_name && !strcmp(pacing_name, "vsync")) pacing_mode = PACING_VSYNC; else
+    if (pacing_name && !strcmp(pacing_name, "cap")) pacing_mode = PACING_CAP; else
+    if (pacing_name && !strcmp(pacing_name, "off")) pacing_mode = PACING_OFF; else
+    if (pacing_name) panic_exit("Unknown pacing mode '%s', expected vsync, cap or off.", pacing_name);
+    if (bench_mode) pacing_mode = PACING_OFF;
+
+    // The swap interval: wait for one refresh, wait unless the frame is late
+    // (adaptive vsync, or late swap tearing), or never wait.
+    int swap_interval = 1;
+    if (present_name && !strcmp(present_name, "vsync")) swap_interval = 1; else
+    if (present_name && !strcmp(present_name, "adaptive")) swap_interval = -1; else
+    if (present_name && !strcmp(present_name, "immediate")) swap_interval = 0; else
+    if (present_name) panic_exit("Unknown present mode '%s', expected vsync, adaptive or immediate.", present_name);
+    // A benchmark must not wait for the display.
+    if (bench_mode) swap_interval = 0;
+
     // Print some debug info.
     if (debug_mode) {
         printf(
             "FRAGGER (Debug)\n"
             "File: %s\n"
-            "Retina Mode: %s\n",
+            "Retina Mode: %s\n"
+            "Headless Mode: %s\n"
+            "Profile Mode: %s\n"
+            "Benchmark Mode: %s\n",
             frag_file_name,
-            retina_mode ? "true" : "false"
+            retina_mode ? "true" : "false",
+            headless_mode ? "true" : "false",
+            profile_mode ? "true" : "false",
+            bench_mode ? "true" : "false"
         );
     }
 
     // Attempt to initialise SDL2.
-    int error = SDL_Init(SDL_INIT_VIDEO);
+    // Headless mode only uses SDL for timing, so it must not touch the video subsystem.
+    int error = SDL_Init(headless_mode ? 0 : SDL_INIT_VIDEO);
     if (error) {
         panic_exit("Could not initialise SDL2.\n%s", SDL_GetError());
     }
 
-    // Set some flags for the window.
-    int window_flags = SDL_WINDOW_RESIZABLE | SDL_WINDOW_OPENGL;
-    // Only allow high-dpi if the retina flag is set.
-    if (retina_mode) window_flags |= SDL_WINDOW_ALLOW_HIGHDPI;
+    SDL_Window * window = NULL;
+    float scale = 1.0f;
 
-    SDL_Window * window = SDL_CreateWindow("",
-        SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        640, 480,
-        window_flags);
-    if (!window) {
-        panic_exit("Could not create window.\n%s", SDL_GetError());
-    }
+    if (headless_mode) {
+#ifdef HEADLESS_SUPPORTED
+        create_headless_context();
 
-    // Set up OpenGL context.
-    SDL_GL_LoadLibrary(NULL);
-    SDL_GL_SetAttribute(SDL_GL_ACCELERATED_VISUAL, 1);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
-    SDL_GL_SetSwapInterval(1);
+        // Dynamically load the OpenGL functions.
+        gladLoadGLLoader((GLADloadproc)eglGetProcAddress);
+#else
+        panic_exit("Headless mode is only supported on Linux.");
+#endif
+    } else {
+        // Describe the OpenGL context. This must come before the window is
+        // created, since some platforms (GLX, WGL) choose the window's pixel
+        // format from these attributes when creating it.
+        SDL_GL_LoadLibrary(NULL);
+        SDL_GL_SetAttribute(SDL_GL_ACCELERATED_VISUAL, 1);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+        // Depth testing is never used, so ask for no depth or stencil buffer.
+        SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 0);
+        SDL_GL_SetAttribute(SDL_GL_STENCIL_SIZE, 0);
 
-    // Attempt to create the context.
-    SDL_GLContext context = SDL_GL_CreateContext(window);
-    if (!context) {
-        panic_exit("Could not create OpenGL context.\n%s", SDL_GetError());
-    }
+        // Set some flags for the window.
+        int window_flags = SDL_WINDOW_RESIZABLE | SDL_WINDOW_OPENGL;
+        // Only allow high-dpi if the retina flag is set.
+        if (retina_mode) window_flags |= SDL_WINDOW_ALLOW_HIGHDPI;
+        // Exported and benchmarked frames all have the size the window started with.
+        if (export_pattern || bench_mode) window_flags &= ~SDL_WINDOW_RESIZABLE;
 
-    // Dynamically load the OpenGL functions.
-    gladLoadGLLoader(SDL_GL_GetProcAddress);
+        window = SDL_CreateWindow("",
+            SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+            requested_width, requested_height,
+            window_flags);
+        if (!window) {
+            panic_exit("Could not create window.\n%s", SDL_GetError());
+        }
 
-    // Get the window dimensions.
-    int width, height;
-    SDL_GL_GetDrawableSize(window, &width, &height);
+        // Attempt to create the context.
+        SDL_GLContext context = SDL_GL_CreateContext(window);
+        if (!context) {
+            panic_exit("Could not create OpenGL context.\n%s", SDL_GetError());
+        }
+        gl_window = window;
+        gl_context = context;
+
+        // The swap interval belongs to the context, so set it now that there
+        // is one. Not every driver supports adaptive vsync.
+        if (SDL_GL_SetSwapInterval(swap_interval) && swap_interval == -1) {
+            if (debug_mode) printf("Adaptive vsync is not supported: %s\n", SDL_GetError());
+            swap_interval = 1;
+            SDL_GL_SetSwapInterval(swap_interval);
+        }
+
+        // Dynamically load the OpenGL functions.
+        gladLoadGLLoader(SDL_GL_GetProcAddress);
+
+        // Get the window dimensions.
+        SDL_GL_GetDrawableSize(window, &width, &height);
+
+        // Calculate scale factor.
+        // The number of drawable pixels differs from the 'window' pixels
+        // on high DPI displays. Scale is based on the ratio of their widths.
+        int window_width;
+        SDL_GetWindowSize(window, &window_width, NULL);
+        scale = (float)width / (float)window_width;
+    }
 
-    // Calculate scale factor.
-    // The number of drawable pixels differs from the 'window' pixels
-    // on high DPI displays. Scale is based on the ratio of their widths.
-    int window_width;
-    SDL_GetWindowSize(window, &window_width, NULL);
-    float scale = (float)width / (float)window_width;
+    // With no window to draw to, render into an offscreen framebuffer instead.
+    Target target = { 0, 0, width, height };
+    if (headless_mode) {
+        target = create_target(width, height, GL_RGBA8);
+        glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+    }
 
     glViewport(0, 0, width, height);
 
@@ -153,115 +4621,202 @@ int main(int argument_count, char ** arguments) {
         printf("Vendor:   %s\n", glGetString(GL_VENDOR));
         printf("Renderer: %s\n", glGetString(GL_RENDERER));
         printf("Version:  %s\n", glGetString(GL_VERSION));
+        if (window) {
+            int interval = SDL_GL_GetSwapInterval();
+            int depth_bits = 0, stencil_bits = 0;
+            SDL_GL_GetAttribute(SDL_GL_DEPTH_SIZE, &depth_bits);
+            SDL_GL_GetAttribute(SDL_GL_STENCIL_SIZE, &stencil_bits);
+            printf("Present:  %s (swap interval %d)\n",
+                interval < 0 ? "adaptive vsync" : interval ? "vsync" : "immediate", interval);
+            printf("Depth:    %d bits, stencil %d bits\n", depth_bits, stencil_bits);
+        }
         printf("\n");
     }
 
-    // Read in the fragment shader file.
-    // Attempt to open the file.
-    FILE * frag_file = fopen(frag_file_name, "r");
-    if (!frag_file) {
-        panic_exit("Could not open file '%s'.", frag_file_name);
+    // Read in the fragment shader file, and attempt to build it.
+    if (cache_mode) {
+        program_cache_init();
+        texture_cache_init();
+    }
+    char message[4096];
+    u64 build_start = SDL_GetPerformanceCounter();
+    Pipeline pipeline;
+    if (!build_pipeline(&pipeline, frag_file_name, message, sizeof(message))) panic_exit("%s", message);
+    if (debug_mode) {
+        printf("Built %d passes in %.1f ms (cache %s).\n",
+            pipeline.pass_count, seconds_between(build_start, SDL_GetPerformanceCounter()) * 1000.0,
+            program_cache.enabled ? program_cache.directory : "disabled");
+        printf("Pass order:");
+        for (int i = 0; i < pipeline.pass_count; ++i) {
+            Pass * pass = &pipeline.passes[pipeline.order[i]];
+            printf(" %s%s", pass->name[0] ? pass->name : "(main)", pass->feedback ? " (feedback)" : "");
+        }
+        printf("\nRedrawn %s.\n\n", pipeline.animated ? "every frame" : "only on input");
     }
-    // Get the length of the file.
-    fseek(frag_file, 0, SEEK_END);
-    int file_length = ftell(frag_file);
-    rewind(frag_file);
-    // Allocate enough space for the whole file.
-    char * frag = calloc(file_length + 1, 1);
-    if (!frag) panic_exit("Could not allocate space for the fragment source.");
-    // Attempt to read the whole file.
-    if (!fread(frag, 1, file_length, frag_file)) {
-        panic_exit("Could not read from file '%s'.", frag_file_name);
+
+    // Rebuild the pipeline whenever one of its files is saved.
+    // Benchmarks must measure the same shader throughout.
+    int reload_mode = window && !bench_mode && !poster_width;
+    Watcher watcher = { 0 };
+    Reloader reloader;
+    if (reload_mode) {
+        watch_init(&watcher, &pipeline);
+        reload_start(&reloader, frag_file_name);
     }
 
-    // This will hold the status of the shader compilation.
-    int status = 0;
+    // Load two triangles that will cover the whole screen.
+    quad_vertex_array = create_fullscreen_quad();
 
-    // Use the simplest possible vertex shader.
-    char vert[] = "#version 330\n"
-                  "in vec4 vert;\n"
-                  "void main() {\n"
-                  "    gl_Position = vert;\n"
-                  "}\n";
-    // Attempt to compile the vertex shader.
-    GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertex_shader, 1, (const char * []) { vert }, NULL);
-    glCompileShader(vertex_shader);
-    glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &status);
-    if (status != GL_TRUE) {
-        char message[512];
-        glGetShaderInfoLog(vertex_shader, 512, NULL, message);
-        panic_exit("Vertex shader compilation failed:\n%s", message);
+    // Start loading images in the background. Fixed timestep output must not
+    // depend on how long they took, and headless runs have nobody watching
+    // them appear, so both wait for them.
+    Channels channels;
+    channels_start(&channels, channel_file_names);
+    if (fixed_timestep || headless_mode) channels_wait(&channels);
+
+    // Benchmarks use the same random sequence every time.
+    if (bench_mode) {
+        set_seed(1, 2);
+    } else {
+        set_seed(SDL_GetPerformanceCounter(), SDL_GetTicks());
     }
 
-    // Attempt to compile the fragment shader.
-    GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragment_shader, 1, (const char * []) { frag }, NULL);
-    glCompileShader(fragment_shader);
-    glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &status);
-    if (status != GL_TRUE) {
-        char message[512];
-        glGetShaderInfoLog(fragment_shader, 512, NULL, message);
-        panic_exit("Fragment shader ('%s') compilation failed:\n%s", frag_file_name, message);
+    int key_is_down = 0;
+    int key_time_stamp = 0;
+
+    // Every pass is given the same values for the built-in uniforms, both as
+    // plain uniforms and through the uniform block.
+    UniformValues values = { 0 };
+    UniformBlock uniform_block;
+    uniform_block_init(&uniform_block);
+    time_t start_time = time(NULL);
+
+    // A poster is drawn once, then fragger exits.
+    if (poster_width) {
+        channels_wait(&channels);
+        values.time = poster_time;
+        values.random = random_float();
+        get_date(start_time, poster_time, values.date);
+        render_poster(&pipeline, &uniform_block, &values, poster_file_name, poster_width, poster_height);
+        return 0;
     }
 
-    // Attempt to create and link the program.
-    GLuint program = glCreateProgram();
-    glAttachShader(program, vertex_shader);
-    glAttachShader(program, fragment_shader);
-    glLinkProgram(program);
-    glGetProgramiv(program, GL_LINK_STATUS, &status);
-    if (status != GL_TRUE) {
-        char message[512];
-        glGetShaderInfoLog(fragment_shader, 512, NULL, message);
-        panic_exit("Shader program link failed.");
+    Exporter exporter;
+    if (export_pattern) {
+        export_start(&exporter, export_pattern, export_format,
+            width, height, frame_rate, drop_frames, gpu_yuv);
     }
 
-    // Make this the active program.
-    glUseProgram(program);
+    YuvConverter converter;
+    if (gpu_yuv) yuv_init(&converter, width, height, export_format == IMAGE_NV12);
 
-    // Load two triangles that will cover the whole screen.
-    GLuint vertex_array_object[1];
-    GLuint buffers[1];
-    const GLuint vertex_count = 6;
-    glGenVertexArrays(1, vertex_array_object);
-    glBindVertexArray(vertex_array_object[0]);
-    GLfloat vertices[vertex_count][2] = {
-        { -1.0, -1.0 }, {  1.0, -1.0 }, {  1.0,  1.0 },
-        {  1.0,  1.0 }, { -1.0,  1.0 }, { -1.0, -1.0 }
-    };
-    glGenBuffers(1, buffers);
-    glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(0);
+    Capturer capturer;
+    capture_init(&capturer, capture_pattern);
+    int capture_requested = 0;
 
-    set_seed(SDL_GetPerformanceCounter(), SDL_GetTicks());
+    Profiler profiler;
+    if (profile_mode) profile_init(&profiler, profile_csv);
+    profiler.quiet = bench_mode;
 
-    int key_is_down = 0;
-    int key_time_stamp = 0;
+    // Draw at a fraction of the output size, if asked to.
+    int scaling = render_scale < 1.0f || frame_budget;
+    Scaler scaler;
+    if (scaling) scale_init(&scaler, render_scale, frame_budget, sharpen);
+
+    // Or draw each frame across many presents.
+    Progressive progressive;
+    if (progressive_slice) progressive_init(&progressive, progressive_slice);
+
+    // Or average many frames into one.
+    Accumulator accumulator;
+    if (accumulate_limit) accumulate_init(&accumulator, accumulate_limit);
+
+    // Or smooth the edges.
+    Antialiaser antialiaser;
+    if (aa_mode) aa_init(&antialiaser, aa_mode, aa_factor, aa_threshold);
+
+    // Windowed frames are paced to the display's refresh rate, or the cap.
+    Pacer pacer;
+    double refresh_rate = 60.0;
+    if (window) {
+        SDL_DisplayMode display_mode;
+        if (!SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &display_mode)
+         && display_mode.refresh_rate > 0) {
+            refresh_rate = display_mode.refresh_rate;
+        }
+        // If swapping does not wait for the display, cap to it instead.
+        if (pacing_mode == PACING_VSYNC && SDL_GL_GetSwapInterval() == 0) pacing_mode = PACING_CAP;
+    }
+    if (pacing_mode == PACING_CAP && max_frame_rate <= 0.0f) max_frame_rate = refresh_rate;
+    pace_init(&pacer, pacing_mode,
+        pacing_mode == PACING_CAP ? max_frame_rate : pacing_mode == PACING_VSYNC ? refresh_rate : 0.0);
+
+    // Bound how far the GPU can fall behind the window's input.
+    FrameLimiter limiter;
+    limit_init(&limiter, frames_in_flight);
 
-    int resolution_location = glGetUniformLocation(program, UNIFORM_RESOLUTION);
-    int mouse_location      = glGetUniformLocation(program, UNIFORM_MOUSE);
-    int time_location       = glGetUniformLocation(program, UNIFORM_TIME);
-    int random_location     = glGetUniformLocation(program, UNIFORM_RANDOM);
-    int button_location     = glGetUniformLocation(program, UNIFORM_BUTTON);
+    MouseLatch mouse_latch_state = { 0 };
+    mouse_latch_state.horizon = predict_milliseconds / 1000.0;
+    LatencyTest latency = { 0 };
 
-    // Set the initial value of the resolution uniform to the current width and height.
-    glUniform2f(resolution_location, width, height);
+    // Used to report the average frame time of a headless run.
+    int frame_index = 0;
+    u64 start_counter = SDL_GetPerformanceCounter();
 
     // Begin the frame loop.
-    while (1) {
+    int running = 1;
+    while (running && (!frame_limit || frame_index < frame_limit)) {
+        u64 frame_start = SDL_GetPerformanceCounter();
+
+        // Swap in a rebuilt pipeline once it is ready.
+        int reloaded_pipeline = 0;
+        if (reload_mode) {
+            if (watch_changed(&watcher)) reload_request(&reloader);
+            Pipeline reloaded;
+            if (reload_poll(&reloader, &reloaded)) {
+                destroy_pipeline(&pipeline);
+                pipeline = reloaded;
+                // The set of passes, and so of files, may have changed.
+                watch_init(&watcher, &pipeline);
+                reloaded_pipeline = 1;
+                if (progressive_slice) progressive_restart(&progressive);
+                if (accumulate_limit) accumulate_reset(&accumulator);
+            }
+        }
+
+        // A shader that does not change by itself (or has accumulated all its
+        // samples) only needs drawing again when something happens, so wait
+        // for an event instead of redrawing the same image. Hot reloading
+        // wakes up regularly to check for saved files, and images that are
+        // still loading keep the loop running.
+        int still = !pipeline.animated || (accumulate_limit && accumulate_done(&accumulator));
+        if (window && frame_index > 0 && still && !fixed_timestep && !reloaded_pipeline
+         && !channels.pending && (!progressive_slice || progressive_idle(&progressive, width, height))) {
+            // Write out any screenshot before going to sleep.
+            capture_finish(&capturer);
+            int woken = reload_mode ? SDL_WaitEventTimeout(NULL, WATCH_POLL_INTERVAL * 1000) : SDL_WaitEvent(NULL);
+            if (!woken) continue;
+            // Draw as soon as something happens.
+            pace_reset(&pacer);
+        }
+
+        // Wait until it is time to start the frame, so that it uses the
+        // latest input and the display is not kept waiting.
+        if (window) pace_wait(&pacer);
+
         // Handle any queued events.
         SDL_Event event;
-        while (SDL_PollEvent(&event)) {
+        while (window && SDL_PollEvent(&event)) {
             if (event.type == SDL_QUIT) {
-                exit(0);
+                running = 0;
             } else if (event.type == SDL_MOUSEMOTION) {
-                // Update the mouse uniform when the mouse has moved.
-                int x = event.motion.x * scale;
-                int y = height - event.motion.y * scale;
-                glUniform2f(mouse_location, x, y);
+                // Only the newest position matters, and it is read again
+                // just before drawing in any case.
+                values.mouse_x = (int)(event.motion.x * scale);
+                values.mouse_y = (int)(height - event.motion.y * scale);
+            } else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F12) {
+                // F12 takes a screenshot rather than acting as a button press.
+                if (!event.key.repeat) capture_requested = 1;
             } else if (event.type == SDL_KEYDOWN) {
                 if (!event.key.repeat) {
                     key_is_down = 1;
@@ -272,40 +4827,183 @@ int main(int argument_count, char ** arguments) {
             } else if (event.type == SDL_WINDOWEVENT) {
                 if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
                     // Update the resolution uniform when the window is resized.
+                    // Passes are reallocated at the new size when next drawn.
                     SDL_GL_GetDrawableSize(window, &width, &height);
-                    glUniform2f(resolution_location, width, height);
                     // Update the view port with the new resolution.
                     glViewport(0, 0, width, height);
                 }
             }
         }
 
+        values.width = width;
+        values.height = height;
+
+        // Benchmarks move the mouse along a fixed path.
+        if (bench_mode) {
+            bench_mouse(frame_index, frame_rate, width, height, &values.mouse_x, &values.mouse_y);
+        }
+
         // Generate a new pseudo-random number for the random uniform.
-        glUniform1f(random_location, random_float());
+        values.random = random_float();
 
-        // Update the time uniform.
-        glUniform1f(time_location, SDL_GetTicks() / 1000.0f);
+        // Update the time uniforms.
+        float previous_time = values.time;
+        if (fixed_timestep) {
+            values.time = frame_index / frame_rate;
+        } else {
+            values.time = SDL_GetTicks() / 1000.0f;
+        }
+        values.delta = frame_index ? values.time - previous_time : 0.0f;
+        values.frame = frame_index;
+        get_date(start_time, values.time, values.date);
 
         // Update the button uniform.
-        if (key_is_down) {
+        if (key_is_down && !bench_mode) {
             float time = SDL_GetTicks() - key_time_stamp;
             time /= 1000.0f;
-            glUniform1f(button_location, time > 1.0f ? 1.0f : time);
+            values.button = time > 1.0f ? 1.0f : time;
         } else {
-            glUniform1f(button_location, 0.0f);
+            values.button = 0.0f;
         }
 
-        // Clear the screen.
-        glClear(GL_COLOR_BUFFER_BIT);
+        // Continue uploading any images that have been loaded. Samples drawn
+        // without an image do not belong in the same mean as those with it.
+        int pending_channels = channels.pending;
+        channels_update(&channels, 0);
+        if (accumulate_limit && channels.pending != pending_channels) accumulate_reset(&accumulator);
+
+        // Read the mouse at the last moment before drawing.
+        if (window && !bench_mode) {
+            mouse_latch(&mouse_latch_state, scale, width, height, &values.mouse_x, &values.mouse_y);
+        }
+
+        // Render each pass, then the main shader over the whole screen.
+        u64 draw_start = SDL_GetPerformanceCounter();
+        if (profile_mode) profile_begin(&profiler, frame_index);
+        target.width = width;
+        target.height = height;
+        if (progressive_slice) {
+            // The values only change when a new frame starts.
+            if (progressive_idle(&progressive, width, height)) {
+                float previous_time = progressive.values.time;
+                progressive.values = values;
+                progressive.values.frame = progressive.frames;
+                progressive.values.delta = progressive.frames ? values.time - previous_time : 0.0f;
+            }
+            uniform_block_update(&uniform_block, &progressive.values);
+            if (progressive_draw(&progressive, &pipeline, &target) && debug_mode) {
+                printf("Drew frame %d across %d presents in %.1f ms.\n", progressive.frames - 1,
+                    progressive.presents, seconds_between(progressive.frame_start, SDL_GetPerformanceCounter()) * 1000.0);
+            }
+        } else if (accumulate_limit) {
+            UniformValues * sample_values = accumulate_values(&accumulator, &values);
+            uniform_block_update(&uniform_block, sample_values);
+            if (accumulate_draw(&accumulator, &pipeline, sample_values, &target) && debug_mode) {
+                printf("Accumulated %d samples in %.1f ms.\n", accumulator.samples,
+                    seconds_between(accumulator.start, SDL_GetPerformanceCounter()) * 1000.0);
+            }
+        } else if (aa_mode) {
+            UniformValues * aa_frame_values = aa_values(&antialiaser, &values, width, height);
+            uniform_block_update(&uniform_block, aa_frame_values);
+            aa_draw(&antialiaser, &pipeline, aa_frame_values, &target);
+        } else if (scaling) {
+            // Shaders see the scaled size, with the mouse scaled to match.
+            Target * scaled = scale_target(&scaler, width, height);
+            UniformValues scaled_values = values;
+            scaled_values.width = scaled->width;
+            scaled_values.height = scaled->height;
+            scaled_values.mouse_x *= (float)scaled->width / width;
+            scaled_values.mouse_y *= (float)scaled->height / height;
+            uniform_block_update(&uniform_block, &scaled_values);
+            draw_pipeline(&pipeline, &scaled_values, scaled);
+            scale_present(&scaler, &target);
+        } else {
+            uniform_block_update(&uniform_block, &values);
+            draw_pipeline(&pipeline, &values, &target);
+        }
+        if (latency_test) latency_stamp(draw_start);
+        if (profile_mode) {
+            profile_end(&profiler);
+            profile_poll(&profiler, 0);
+        }
+
+        if (export_pattern) {
+            if (gpu_yuv) yuv_convert(&converter, &target);
+            export_frame(&exporter, frame_index, draw_start);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, target.framebuffer);
+        }
+
+        // Start a screenshot, and write out any earlier ones that are ready.
+        if (capture_requested || frame_index == capture_at_frame) {
+            capture_frame(&capturer, frame_index, width, height);
+            capture_requested = 0;
+        }
+        capture_poll(&capturer);
+
+        // Headless frames are never shown, so render them back to back.
+        double swap_seconds = 0.0;
+        if (window) {
+            // Display the results.
+            u64 swap_start = SDL_GetPerformanceCounter();
+            SDL_GL_SwapWindow(window);
+            swap_seconds = seconds_between(swap_start, SDL_GetPerformanceCounter());
+            pace_presented(&pacer, swap_start);
+            limit_frame(&limiter);
+        }
+
+        // The cost of a frame is the time from starting to draw it until the
+        // GPU has caught up enough to start the next, less any time the swap
+        // spent waiting for the display.
+        if (scaling) {
+            double cost = seconds_between(draw_start, SDL_GetPerformanceCounter()) - swap_seconds;
+            if (scale_adjust(&scaler, cost * 1000.0) && debug_mode) {
+                printf("Scale %.2f (%dx%d) for frames taking %.2f ms on average.\n", scaler.scale,
+                    (int)(width * scaler.scale + 0.5f), (int)(height * scaler.scale + 0.5f), scaler.average);
+            }
+        }
+        if (latency_test) latency_measure(&latency, target.framebuffer);
 
-        // Render the screen-covering triangles.
-        glBindVertexArray(vertex_array_object[0]);
-        glDrawArrays(GL_TRIANGLES, 0, vertex_count);
+        if (bench_mode) {
+            double cpu_ms = seconds_between(frame_start, SDL_GetPerformanceCounter()) * 1000.0;
+            glFinish();
+            double frame_ms = seconds_between(frame_start, SDL_GetPerformanceCounter()) * 1000.0;
+            profile_poll(&profiler, 1);
+            double gpu_ms = profiler.last_frame == frame_index ? profiler.last_milliseconds : -1.0;
+            if (!bench_frame(&bench, frame_index, frame_ms, cpu_ms, gpu_ms)) running = 0;
+        }
+        ++frame_index;
+    }
 
-        // Sleep to avoid very high CPU usage.
-        SDL_Delay(5);
+    if (window && debug_mode) {
+        pace_report(&pacer);
+        limit_report(&limiter);
+    }
+    if (aa_mode && debug_mode) aa_report(&antialiaser);
+    limit_finish(&limiter);
+    if (latency_test) latency_report(&latency);
+    if (reload_mode) reload_finish(&reloader);
+    if (export_pattern) export_finish(&exporter);
+    capture_finish(&capturer);
+    if (profile_mode) profile_finish(&profiler);
 
-        // Display the results.
-        SDL_GL_SwapWindow(window);
+    if (bench_mode) {
+        FILE * report = stdout;
+        if (report_file_name) {
+            report = fopen(report_file_name, "w");
+            if (!report) panic_exit("Could not open file '%s' for writing.", report_file_name);
+        }
+        bench_report(&bench, report, frag_file_name, width, height, headless_mode);
+        if (report != stdout && fclose(report)) {
+            panic_exit("Could not write to file '%s'.", report_file_name);
+        }
+    } else if (headless_mode && !export_pattern) {
+        // Wait for the GPU so the timing covers all of the work.
+        glFinish();
+        double seconds = (double)(SDL_GetPerformanceCounter() - start_counter)
+                       / (double)SDL_GetPerformanceFrequency();
+        printf("Rendered %d frames at %dx%d in %.3f s (%.3f ms per frame).\n",
+            frame_index, width, height, seconds, seconds * 1000.0 / frame_index);
     }
+
+    return 0;
 }